@@ -118,29 +118,126 @@ static const char *names[6] = {
     "cubenz.png",
 };
 
+static const char *texs[6] = {
+    "cubepx.dds",
+    "cubenx.dds",
+    "cubepy.dds",
+    "cubeny.dds",
+    "cubepz.dds",
+    "cubenz.dds",
+};
+
+static const char *ktxs[6] = {
+    "cubepx.ktx2",
+    "cubenx.ktx2",
+    "cubepy.ktx2",
+    "cubeny.ktx2",
+    "cubepz.ktx2",
+    "cubenz.ktx2",
+};
+
+/* Upload all levels of a precompressed or pre-mipmapped texture.             */
+
+static void load_tex(struct image_texture *T)
+{
+    int l;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    for (l = 0; l < T->n; ++l)
+    {
+        const int w = (T->w >> l) ? (T->w >> l) : 1;
+        const int h = (T->h >> l) ? (T->h >> l) : 1;
+
+        if (T->type)
+            glTexImage2D(GL_TEXTURE_2D, l, T->form, w, h, 0,
+                         T->extf, T->type, T->v[l]);
+        else
+            glCompressedTexImage2D(GL_TEXTURE_2D, l, T->form, w, h, 0,
+                                   (GLsizei) T->s[l], T->v[l]);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, T->n - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                                   GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
 /* Load all texture images and initialize all OpenGL exture objects.          */
 
 static void init_tex(struct cube *C)
 {
-    void *p;
+    struct image_texture T;
+
+    image_job *J[6];
+
+    void *v[32];
     int   w;
     int   h;
     int   c;
     int   b;
     int   i;
+    int   l;
+    int   n;
+
+    /* Prefer a precompressed DDS or KTX2 texture, uploaded straight from */
+    /* the file. Queue the decoding of any others to run concurrently.    */
 
     for (i = 0; i < 6; ++i)
-        if ((p = image_read(names[i], &w, &h, &c, &b)))
+        if (image_read_texture(texs[i], &T, 0, 0) ||
+            image_read_texture(ktxs[i], &T, 0, 0))
         {
-            int f = image_internal_form(c, b);
-            int e = image_external_form(c);
-            int t = image_external_type(b);
-            
             glBindTexture(GL_TEXTURE_2D, C->tex[i]);
-            glTexImage2D (GL_TEXTURE_2D, 0, f, w, h, 0, e, t, p);
-            
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            load_tex(&T);
+            image_free_texture(&T);
+            J[i] = NULL;
+        }
+        else J[i] = image_async(names[i], NULL, 0, IMAGE_TOP_LEFT);
+
+    /* Upload each decoded image as it completes. */
+
+    for (i = 0; i < 6; ++i)
+        if (J[i] && (v[0] = image_await(J[i], &w, &h, &c, &b)))
+        {
+            int f;
+            int e;
+            int t;
+            int s[4];
+            int k = image_format(c, b, IMAGE_EXPAND, &f, &e, &t, s);
+
+            /* Pad RGB to RGBA so that the driver need not repack it. */
+
+            if (k != c)
+            {
+                void *p = image_convert(w, h, c, b, v[0], k, b, NULL, 0);
+
+                image_free(v[0]);
+                v[0] = p;
+                c    = k;
+            }
+
+            /* Generate the mipmap chain and upload each level. */
+
+            n = image_mipmaps(w, h, c, b, v, IMAGE_SRGB);
+
+            glBindTexture(GL_TEXTURE_2D, C->tex[i]);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+            for (l = 0; l < n; ++l)
+            {
+                glTexImage2D(GL_TEXTURE_2D, l, f, w, h, 0, e, t, v[l]);
+
+                w = (w > 1) ? w / 2 : 1;
+                h = (h > 1) ? h / 2 : 1;
+            }
+
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                                           GL_LINEAR_MIPMAP_LINEAR);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, s);
+
+            if (n > 1)
+                image_free(v[1]);
+            image_free(v[0]);
         }
 }
 
@@ -19,120 +19,1374 @@
 /* DEALINGS IN THE SOFTWARE.                                                  */
 
 #include <math.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <GL/glew.h>
 
+#ifndef CONFIG_NO_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "math3d.h"
 #include "image.h"
 #include "demo.h"
 #include "glsl.h"
 
 /*----------------------------------------------------------------------------*/
 
-static int         demo_mode;
-static demo_init_f demo_init;
-static demo_tilt_f demo_tilt;
-static demo_quit_f demo_quit;
-static demo_step_f demo_step;
-static demo_draw_f demo_draw;
+static int         demo_mode;
+static demo_init_f demo_init;
+static demo_tilt_f demo_tilt;
+static demo_quit_f demo_quit;
+static demo_step_f demo_step;
+static demo_draw_f demo_draw;
+
+static GLuint clear_vert;
+static GLuint clear_frag;
+static GLuint clear;
+static GLint  clear_T;
+static GLint  clear_B;
+static GLuint clear_buffer[2];
+static GLuint clear_array[2];
+
+static double t0;
+static double dt;
+static double timestep;
+
+/* Framebuffer size, tracked here so that headless mode needs no window.     */
+
+static int    window_w = 1024;
+static int    window_h = 768;
+static int    headless;
+static GLuint headless_fbo;
+static GLuint headless_rbo[2];
+
+/*----------------------------------------------------------------------------*/
+
+static double   last_time;
+
+/* Camera state.                                                              */
+
+static GLfloat  position[4] = {   0.0,  0.0,  5.0,  1.0 };
+static GLfloat  rotation[2] = {   0.0,  0.0             };
+static GLfloat  velocity[3] = {   0.0,  0.0,  0.0       };
+static GLfloat  light[2]    = { -60.0, 30.0             };
+static GLfloat  point[4]    = {   0.0,  0.0,  0.0,  0.0 };
+static GLfloat  zoom        = 0.5;
+
+/* Camera state at the beginning of a click.                                  */
+
+static int      click_modifiers;
+static int      click_button = -1;
+static int      click_x;
+static int      click_y;
+static GLfloat  click_rotation[2];
+static GLfloat  click_light[2];
+static GLfloat  click_zoom;
+
+/* Transformations derived from the camera state.                             */
+
+static GLfloat  view[16];
+static GLfloat  projection[16];
+static GLfloat  vector[4];
+
+/*----------------------------------------------------------------------------*/
+
+/* Compute the direction of a light rotated about Y then X, in degrees.       */
+
+static void light_direction(real *v, const GLfloat *l)
+{
+    v[0] =  sin(radians(l[1])) * cos(radians(l[0]));
+    v[1] = -sin(radians(l[0]));
+    v[2] =  cos(radians(l[1])) * cos(radians(l[0]));
+}
+
+/* Compute the view and projection matrices and the light vector from the    */
+/* camera state. These are computed on the CPU rather than using the OpenGL   */
+/* matrix stack, so that they may be read back without stalling and given to  */
+/* shaders as uniforms.                                                       */
+
+static void transform(void)
+{
+    const real V = 0.1 * zoom;
+    const real H = 0.1 * zoom * window_w / window_h;
+
+    real p[3];
+    real A[16];
+    real B[16];
+    real C[16];
+    real M[16];
+    int  i;
+
+    p[0] = -position[0];
+    p[1] = -position[1];
+    p[2] = -position[2];
+
+    switch (demo_mode)
+    {
+    case DEMO_FLY:
+        mrotatex  (A, radians(rotation[0]));
+        mrotatey  (B, radians(rotation[1]));
+        mtranslate(C, p);
+        mmultiply (M, A, B);
+        mcompose  (M, C);
+        break;
+
+    case DEMO_DOLLY:
+        p[0] = 0.0;
+        p[1] = 0.0;
+        mtranslate(M, p);
+        break;
+
+    case DEMO_TUMBLE:
+        mtranslate(A, p);
+        mrotatex  (B, radians(rotation[0]));
+        mrotatey  (C, radians(rotation[1]));
+        mmultiply (M, A, B);
+        mcompose  (M, C);
+        break;
+
+    default:
+        midentity(M);
+        break;
+    }
+
+    for (i = 0; i < 16; ++i)
+        view[i] = (GLfloat) M[i];
+
+    mperspective(M, -H, H, -V, V, 0.1, 100.0);
+
+    for (i = 0; i < 16; ++i)
+        projection[i] = (GLfloat) M[i];
+
+    light_direction(p, light);
+
+    vector[0] = (GLfloat) p[0];
+    vector[1] = (GLfloat) p[1];
+    vector[2] = (GLfloat) p[2];
+    vector[3] = 0.0f;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Write the current view state to the file named by the DEMO_STATE env var.  */
+
+static void state_save()
+{
+    const char *filename;
+    FILE       *file;
+
+    if ((filename = getenv("DEMO_STATE")))
+    {
+        if ((file = fopen(filename, "w")))
+        {
+            fprintf(file, "%f %f %f %f %f %f %f %f\n",
+                position[0],
+                position[1],
+                position[2],
+                rotation[0],
+                rotation[1],
+                light[0],
+                light[1],
+                zoom);
+            fclose(file);
+        }
+    }
+}
+
+/* Read the current view state from the file named by the DEMO_STATE env var. */
+
+static void state_load()
+{
+    const char *filename;
+    FILE       *file;
+
+    if ((filename = getenv("DEMO_STATE")))
+    {
+        if ((file = fopen(filename, "r")))
+        {
+            fscanf(file, "%f %f %f %f %f %f %f %f",
+                position + 0,
+                position + 1,
+                position + 2,
+                rotation + 0,
+                rotation + 1,
+                light + 0,
+                light + 1,
+                &zoom);
+            fclose(file);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Frame timing uses the monotonic clock. If the DEMO_TRACE env var names a   */
+/* file, then the CPU time of each frame's step, draw, and swap, the total    */
+/* frame time, and the GPU time of the draw are recorded. GPU timer queries   */
+/* are polled each frame and read only once complete, so that they never      */
+/* stall the pipeline. A query still incomplete when its object is reused     */
+/* QUERY_RING frames later is dropped, and its GPU time is left negative. At  */
+/* exit the trace is written as CSV and percentiles are reported.             */
+
+#define QUERY_RING 8
+
+struct sample
+{
+    double step;
+    double draw;
+    double swap;
+    double frame;
+    double gpu;
+};
+
+static struct sample  current;
+static struct sample *samples;
+static int            sample_count;
+static int            sample_max;
+static int            tracing;
+static GLuint         queries[QUERY_RING];
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
+
+/* Append the current frame's sample to the trace.                            */
+
+static void trace_commit(void)
+{
+    if (tracing)
+    {
+        if (sample_count == sample_max)
+        {
+            struct sample *s;
+            int            n = sample_max ? sample_max * 2 : 1024;
+
+            if ((s = (struct sample *) realloc(samples,
+                                               n * sizeof (struct sample))))
+            {
+                samples    = s;
+                sample_max = n;
+            }
+        }
+        if (sample_count < sample_max)
+            samples[sample_count++] = current;
+    }
+    memset(&current, 0, sizeof (struct sample));
+}
+
+/* Store the GPU time of frame i, if its query is complete or if w is set.    */
+/* A negative time marks a query not yet read.                                */
+
+static void query_retire(int i, int w)
+{
+    GLuint    q = queries[i % QUERY_RING];
+    GLint     a = 0;
+    GLuint64  t;
+
+    if (i >= 0 && i < sample_count && q && samples[i].gpu < 0.0)
+    {
+        if (w == 0)
+            glGetQueryObjectiv(q, GL_QUERY_RESULT_AVAILABLE, &a);
+
+        if (w || a)
+        {
+            glGetQueryObjectui64v(q, GL_QUERY_RESULT, &t);
+            samples[i].gpu = t / 1000000.0;
+        }
+    }
+}
+
+static void query_begin(void)
+{
+    if (tracing && GLEW_ARB_timer_query)
+    {
+        GLuint *q = queries + sample_count % QUERY_RING;
+        int     i;
+
+        for (i = sample_count - QUERY_RING; i < sample_count; ++i)
+            query_retire(i, 0);
+
+        if (*q == 0)
+            glGenQueries(1, q);
+
+        glBeginQuery(GL_TIME_ELAPSED, *q);
+        current.gpu = -1.0;
+    }
+}
+
+static void query_end(void)
+{
+    if (tracing && GLEW_ARB_timer_query)
+        glEndQuery(GL_TIME_ELAPSED);
+}
+
+static int compare(const void *a, const void *b)
+{
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+
+    return (x < y) ? -1 : ((x > y) ? +1 : 0);
+}
+
+/* Report the 50th, 90th, and 99th percentiles and maximum of n values.       */
+
+static void summarize(const char *name, double *v, int n)
+{
+    qsort(v, n, sizeof (double), compare);
+
+    fprintf(stderr, "%-6s %8.3f %8.3f %8.3f %8.3f\n", name,
+            v[(n * 50 + 99) / 100 - 1],
+            v[(n * 90 + 99) / 100 - 1],
+            v[(n * 99 + 99) / 100 - 1],
+            v[n - 1]);
+}
+
+static void trace_write(void)
+{
+    const char *name;
+    double     *v;
+    FILE       *file;
+    int         i;
+    int         k;
+    int         n;
+
+    if (tracing && sample_count > 0)
+    {
+        /* Collect the outstanding GPU times. */
+
+        if (GLEW_ARB_timer_query)
+        {
+            for (i = sample_count - QUERY_RING + 1; i < sample_count; ++i)
+                query_retire(i, 1);
+
+            glDeleteQueries(QUERY_RING, queries);
+        }
+
+        /* Write all samples. */
+
+        if ((name = getenv("DEMO_TRACE")) && (file = fopen(name, "w")))
+        {
+            fprintf(file, "frame,step,draw,swap,total,gpu\n");
+
+            for (i = 0; i < sample_count; ++i)
+            {
+                fprintf(file, "%d,%.4f,%.4f,%.4f,%.4f,", i,
+                        samples[i].step,
+                        samples[i].draw,
+                        samples[i].swap,
+                        samples[i].frame);
+
+                if (samples[i].gpu >= 0.0)
+                    fprintf(file, "%.4f", samples[i].gpu);
+
+                fprintf(file, "\n");
+            }
+
+            fclose(file);
+        }
+
+        /* Summarize each column. */
+
+        if ((v = (double *) malloc(sample_count * sizeof (double))))
+        {
+            static const char *names[5] = {
+                "step", "draw", "swap", "total", "gpu"
+            };
+            static const size_t offset[5] = {
+                offsetof(struct sample, step),
+                offsetof(struct sample, draw),
+                offsetof(struct sample, swap),
+                offsetof(struct sample, frame),
+                offsetof(struct sample, gpu),
+            };
+
+            fprintf(stderr, "%d frames\n", sample_count);
+            fprintf(stderr, "%-6s %8s %8s %8s %8s\n", "ms",
+                    "p50", "p90", "p99", "max");
+
+            /* Skip any dropped GPU times. */
+
+            for (k = 0; k < 5; ++k)
+            {
+                for (n = 0, i = 0; i < sample_count; ++i)
+                    if ((v[n] = *(const double *) ((const char *) (samples + i)
+                                                            + offset[k])) >= 0.0)
+                        n++;
+                if (n)
+                    summarize(names[k], v, n);
+            }
+            free(v);
+        }
+    }
+    free(samples);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Camera paths. If the DEMO_PATH_RECORD env var names a file, then the view  */
+/* state of every step is appended there, with the time. If DEMO_PATH_PLAY    */
+/* names such a file, then the view is driven along the recorded path. The    */
+/* camera orientation follows a squad spline of quaternions, the light        */
+/* direction a spherical interpolation, and the position a Catmull-Rom spline.*/
+/* At the end of the path, frame time statistics are reported and the demo   */
+/* exits. Combined with DEMO_TIMESTEP, every run renders identical frames.    */
+
+struct key
+{
+    double t;
+    real   p[3];
+    real   q[4];
+    real   l[3];
+    real   z;
+};
+
+static FILE       *path_file;
+static struct key *path_keys;
+static int         path_count;
+static double      path_time;
+
+/* Compute the quaternion of a camera rotation about X then Y, in degrees.    */
+
+static void path_quaternion(real *q, const GLfloat *r)
+{
+    static const real X[3] = { 1.0, 0.0, 0.0 };
+    static const real Y[3] = { 0.0, 1.0, 0.0 };
+
+    real a[4];
+    real b[4];
+
+    qrotate(a, X, radians(r[0]));
+    qrotate(b, Y, radians(r[1]));
+    qmultiply(q, a, b);
+}
+
+static real catmull(real a, real b, real c, real d, real t)
+{
+    return b + 0.5 * t * (c - a + t * (2.0 * a - 5.0 * b + 4.0 * c - d
+                                + t * (3.0 * (b - c) + d - a)));
+}
+
+static int path_load(const char *name)
+{
+    struct key  k;
+    FILE       *file;
+    GLfloat     v[9];
+    int         n = 0;
+
+    if ((file = fopen(name, "r")))
+    {
+        while (fscanf(file, "%f %f %f %f %f %f %f %f %f",
+                      v + 0, v + 1, v + 2, v + 3, v + 4,
+                      v + 5, v + 6, v + 7, v + 8) == 9)
+        {
+            /* Keys must advance in time. */
+
+            if (path_count && v[0] <= path_keys[path_count - 1].t)
+                continue;
+
+            if (path_count == n)
+            {
+                struct key *p;
+
+                n = n ? n * 2 : 256;
+
+                if ((p = (struct key *) realloc(path_keys,
+                                                n * sizeof (struct key))))
+                    path_keys = p;
+                else
+                    break;
+            }
+
+            k.t    = v[0];
+            k.p[0] = v[1];
+            k.p[1] = v[2];
+            k.p[2] = v[3];
+            k.z    = v[8];
+
+            path_quaternion(k.q, v + 4);
+            light_direction(k.l, v + 6);
+
+            path_keys[path_count++] = k;
+        }
+        fclose(file);
+    }
+    return path_count > 1;
+}
+
+/* Set the view state to that of the path at time t.                          */
+
+static void path_apply(double t)
+{
+    const struct key *a;
+    const struct key *b;
+    const struct key *c;
+    const struct key *d;
+
+    real M[16];
+    real q[4];
+    real l[3];
+    real u;
+    int  i = 0;
+
+    while (i < path_count - 2 && path_keys[i + 1].t <= t)
+        i++;
+
+    a = path_keys + (i > 0 ? i - 1 : 0);
+    b = path_keys + (i);
+    c = path_keys + (i + 1);
+    d = path_keys + (i + 2 < path_count ? i + 2 : i + 1);
+
+    u = (t - b->t) / (c->t - b->t);
+    u = (u < 0.0) ? 0.0 : ((u > 1.0) ? 1.0 : u);
+
+    /* Interpolate the position and zoom. */
+
+    position[0] = catmull(a->p[0], b->p[0], c->p[0], d->p[0], u);
+    position[1] = catmull(a->p[1], b->p[1], c->p[1], d->p[1], u);
+    position[2] = catmull(a->p[2], b->p[2], c->p[2], d->p[2], u);
+    zoom        = lerp(b->z, c->z, u);
+
+    /* Interpolate the camera orientation, giving X and Y rotation angles. */
+
+    qsquad(q, a->q, b->q, c->q, d->q, u);
+    mquaternion(M, q);
+
+    rotation[0] = degrees(atan2(M[6], M[5]));
+    rotation[1] = degrees(atan2(M[8], M[0]));
+
+    /* Interpolate the light direction, giving Y and X rotation angles. */
+
+    vslerp(l, b->l, c->l, u);
+
+    light[0] = degrees(atan2(-l[1], sqrt(l[0] * l[0] + l[2] * l[2])));
+    light[1] = degrees(atan2( l[0], l[2]));
+}
+
+static void path_init(void)
+{
+    const char *name;
+
+    if ((name = getenv("DEMO_PATH_PLAY")))
+    {
+        if (path_load(name))
+        {
+            path_time = path_keys[0].t;
+            tracing   = 1;
+            path_apply(path_time);
+        }
+        else fprintf(stderr, "demo: Failure to load camera path %s\n", name);
+    }
+    if ((name = getenv("DEMO_PATH_RECORD")))
+        path_file = fopen(name, "w");
+}
+
+/* Advance the path by dt seconds, returning zero at its end.                 */
+
+static int path_step(double dt)
+{
+    path_time += dt;
+
+    if (path_count > 1)
+        path_apply(path_time);
+
+    if (path_file)
+        fprintf(path_file, "%f %f %f %f %f %f %f %f %f\n", path_time,
+                position[0],
+                position[1],
+                position[2],
+                rotation[0],
+                rotation[1],
+                light[0],
+                light[1],
+                zoom);
+
+    if (path_count > 1)
+        return (path_time <= path_keys[path_count - 1].t);
+    else
+        return 1;
+}
+
+static void path_free(void)
+{
+    if (path_file)
+        fclose(path_file);
+
+    free(path_keys);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Frames are captured asynchronously. Each is read back to the next of a     */
+/* ring of pixel buffer objects and fenced. The frame read CAPTURE_LAG frames */
+/* earlier, whose transfer has normally completed by then, is mapped, copied, */
+/* and queued to a background thread for encoding. Continuous capture writes  */
+/* numbered files, or appends to a raw stream if the name has no conversion.  */
+
+#define CAPTURE_RING  3
+#define CAPTURE_LAG   2
+#define CAPTURE_QUEUE 8
+
+struct frame
+{
+    struct frame *next;
+    char         *name;
+    int           w;
+    int           h;
+    void         *p;
+};
+
+struct slot
+{
+    GLuint  pbo;
+    GLsync  sync;
+    size_t  size;
+    char   *name;
+    int     w;
+    int     h;
+};
+
+static struct slot     slots[CAPTURE_RING];
+static int             slot_count;
+static int             snap_pending;
+static int             recording;
+static int             record_count;
+
+static pthread_t       capture_thread;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  capture_put   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  capture_take  = PTHREAD_COND_INITIALIZER;
+static struct frame   *capture_head;
+static struct frame   *capture_tail;
+static int             capture_size;
+static int             capture_quit;
+static int             capture_started;
+static FILE           *capture_raw;
+
+static const char *record_pattern(void)
+{
+    const char *pattern = getenv("DEMO_RECORD");
+    return pattern ? pattern : "frame%05d.qoi";
+}
+
+/* Count the conversions in a record pattern, returning -1 if any is not a    */
+/* plain integer conversion. The pattern comes from the environment and is    */
+/* given to snprintf with a single int, so nothing else may be allowed.       */
+
+static int record_conversions(const char *p)
+{
+    int n = 0;
+
+    for (; *p; ++p)
+        if (*p == '%')
+        {
+            if (p[1] == '%')
+                p++;
+            else
+            {
+                p += 1 + strspn(p + 1, "-+ #0");
+                p += strspn(p, "0123456789");
+
+                if (*p == '.')
+                    p += 1 + strspn(p + 1, "0123456789");
+
+                if (*p == 'd' || *p == 'i' || *p == 'u')
+                    n++;
+                else
+                    return -1;
+            }
+        }
+    return n;
+}
+
+/* Encode frame F and release it. Raw frames are written top-down.            */
+
+static void capture_encode(struct frame *F)
+{
+    int y;
+
+    if (F->name)
+        image_write_from(F->name, F->w, F->h, 4, 1, F->p, 0,
+                         IMAGE_BOTTOM_LEFT);
+
+    else if (capture_raw || (capture_raw = fopen(record_pattern(), "wb")))
+        for (y = F->h - 1; y >= 0; --y)
+            fwrite((char *) F->p + (size_t) y * F->w * 4, 4, F->w, capture_raw);
+
+    free(F->name);
+    free(F->p);
+    free(F);
+}
+
+/* Encode queued frames until told to quit.                                   */
+
+static void *capture_run(void *data)
+{
+    struct frame *F;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&capture_mutex);
+        {
+            while (capture_head == NULL && capture_quit == 0)
+                pthread_cond_wait(&capture_put, &capture_mutex);
+
+            if ((F = capture_head))
+            {
+                if ((capture_head = F->next) == NULL)
+                    capture_tail = NULL;
+
+                capture_size--;
+                pthread_cond_signal(&capture_take);
+            }
+        }
+        pthread_mutex_unlock(&capture_mutex);
+
+        if (F == NULL)
+            break;
+
+        capture_encode(F);
+    }
+    return NULL;
+}
+
+/* Queue a frame for encoding, blocking while the queue is full. If the       */
+/* encoding thread cannot be started, encode the frame immediately instead.   */
+
+static void capture_queue(char *name, int w, int h, void *p)
+{
+    struct frame *F;
+
+    if ((F = (struct frame *) malloc(sizeof (struct frame))))
+    {
+        F->next = NULL;
+        F->name = name;
+        F->w    = w;
+        F->h    = h;
+        F->p    = p;
+
+        if (capture_started == 0)
+            capture_started = (pthread_create(&capture_thread, NULL,
+                                              capture_run, NULL) == 0) ? 1 : -1;
+        if (capture_started < 0)
+        {
+            capture_encode(F);
+            return;
+        }
+
+        pthread_mutex_lock(&capture_mutex);
+        {
+            while (capture_size >= CAPTURE_QUEUE)
+                pthread_cond_wait(&capture_take, &capture_mutex);
+
+            if (capture_tail)
+                capture_tail->next = F;
+            else
+                capture_head = F;
+
+            capture_tail = F;
+            capture_size++;
+
+            pthread_cond_signal(&capture_put);
+        }
+        pthread_mutex_unlock(&capture_mutex);
+    }
+}
+
+/* Wait for the readback into slot S, then copy it out and queue it.          */
+
+static void capture_retire(struct slot *S)
+{
+    void *p;
+    void *q;
+
+    if (S->sync)
+    {
+        while (glClientWaitSync(S->sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(S->sync);
+        S->sync = NULL;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, S->pbo);
+
+        if ((p = malloc((size_t) S->w * S->h * 4)))
+        {
+            if ((q = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)))
+            {
+                memcpy(p, q, (size_t) S->w * S->h * 4);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                capture_queue(S->name, S->w, S->h, p);
+            }
+            else
+            {
+                free(S->name);
+                free(p);
+            }
+        }
+        else free(S->name);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        S->name = NULL;
+    }
+}
+
+/* Begin the readback of the w-by-h framebuffer to slot S.                    */
+
+static void capture_read(struct slot *S, char *name, int w, int h)
+{
+    const size_t n = (size_t) w * h * 4;
+
+    if (S->pbo == 0)
+        glGenBuffers(1, &S->pbo);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, S->pbo);
+
+    if (S->size != n)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, n, NULL, GL_STREAM_READ);
+        S->size = n;
+    }
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    S->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    S->name = name;
+    S->w    = w;
+    S->h    = h;
+}
+
+/* Capture the current frame if a snapshot or recording calls for it, and     */
+/* retire the readback begun CAPTURE_LAG frames ago. Without buffer objects   */
+/* and fences, read back directly, leaving only encoding asynchronous.        */
+
+static void capture(int w, int h)
+{
+    char *name = NULL;
+    int   want = 0;
+
+    if (snap_pending)
+    {
+        const char *snap = getenv("DEMO_SNAP");
+
+        if ((name = (char *) malloc(strlen(snap ? snap : "out.qoi") + 1)))
+            strcpy(name, snap ? snap : "out.qoi");
+
+        snap_pending = 0;
+        want = 1;
+    }
+    else if (recording)
+    {
+        const char *pattern = record_pattern();
+        const int   k       = record_conversions(pattern);
+
+        if (k == 1)
+        {
+            const size_t n = strlen(pattern) + 32;
+
+            if ((name = (char *) malloc(n)))
+                snprintf(name, n, pattern, record_count++);
+        }
+        if (k == 0 || k == 1)
+            want = 1;
+        else
+        {
+            fprintf(stderr, "demo: Invalid DEMO_RECORD pattern %s\n", pattern);
+            recording = 0;
+        }
+    }
+
+    if (GLEW_ARB_pixel_buffer_object && GLEW_ARB_sync)
+    {
+        struct slot *S = slots + (slot_count             ) % CAPTURE_RING;
+        struct slot *T = slots + (slot_count + CAPTURE_RING
+                                             - CAPTURE_LAG) % CAPTURE_RING;
+        if (want)
+        {
+            capture_retire(S);
+            capture_read  (S, name, w, h);
+        }
+        capture_retire(T);
+        slot_count++;
+    }
+    else if (want)
+    {
+        void *p;
+
+        if ((p = malloc((size_t) w * h * 4)))
+        {
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, p);
+            capture_queue(name, w, h, p);
+        }
+        else free(name);
+    }
+}
+
+/* Retire all readbacks, finish encoding, and release the capture resources. */
+
+static void capture_stop(void)
+{
+    int i;
+
+    for (i = 0; i < CAPTURE_RING; ++i)
+        capture_retire(slots + (slot_count + i) % CAPTURE_RING);
+
+    for (i = 0; i < CAPTURE_RING; ++i)
+        if (slots[i].pbo)
+            glDeleteBuffers(1, &slots[i].pbo);
+
+    if (capture_started > 0)
+    {
+        pthread_mutex_lock(&capture_mutex);
+        {
+            capture_quit = 1;
+            pthread_cond_signal(&capture_put);
+        }
+        pthread_mutex_unlock(&capture_mutex);
+
+        pthread_join(capture_thread, NULL);
+    }
+    if (capture_raw)
+        fclose(capture_raw);
+}
+
+static void snap(void)
+{
+    snap_pending = 1;
+}
+
+static void record(void)
+{
+    recording = !recording;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* In pipelined mode, demo_step for frame N+1 runs on a worker thread while   */
+/* frame N is drawn. The demo keeps two copies of any state shared by step    */
+/* and draw, and the swap callback, called on the main thread between the two */
+/* with neither running, exchanges them. Thus step writes one copy while draw */
+/* reads the other, and each frame shows the results of the previous step.    */
+
+static demo_swap_f     demo_swap;
+
+static pthread_t       step_thread;
+static pthread_mutex_t step_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  step_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  step_done  = PTHREAD_COND_INITIALIZER;
+static int             step_started;
+static int             step_busy;
+static int             step_ran;
+static GLfloat         step_dt;
+
+/* A copy of the camera state taken as each pipelined step begins. The main   */
+/* thread goes on to change the camera while the step runs, so demo_get gives */
+/* this copy when called on the worker, or on any thread running a job band   */
+/* submitted by it. A thread-specific pointer marks such threads.             */
+
+struct camera
+{
+    GLfloat position[4];
+    GLfloat rotation[2];
+    GLfloat light[2];
+    GLfloat point[4];
+    GLfloat zoom;
+    GLfloat view[16];
+    GLfloat projection[16];
+    GLfloat vector[4];
+};
+
+static struct camera   step_camera;
+static pthread_key_t   camera_key;
+static pthread_once_t  camera_once = PTHREAD_ONCE_INIT;
+
+static void camera_key_create(void)
+{
+    pthread_key_create(&camera_key, NULL);
+}
+
+static const struct camera *camera_local(void)
+{
+    pthread_once(&camera_once, camera_key_create);
+    return (const struct camera *) pthread_getspecific(camera_key);
+}
+
+static void camera_set_local(const struct camera *C)
+{
+    pthread_once(&camera_once, camera_key_create);
+    pthread_setspecific(camera_key, C);
+}
+
+static void *step_run(void *data)
+{
+    GLfloat t;
+
+    camera_set_local(&step_camera);
+
+    pthread_mutex_lock(&step_mutex);
+    for (;;)
+    {
+        while (step_busy == 0)
+            pthread_cond_wait(&step_start, &step_mutex);
+
+        t = step_dt;
+        pthread_mutex_unlock(&step_mutex);
+
+        demo_step(t);
+
+        pthread_mutex_lock(&step_mutex);
+        step_busy = 0;
+        pthread_cond_signal(&step_done);
+    }
+    return NULL;
+}
+
+/* Wait for the step in progress, if any, to complete.                        */
+
+static void step_join(void)
+{
+    if (step_started)
+    {
+        pthread_mutex_lock(&step_mutex);
+        while (step_busy)
+            pthread_cond_wait(&step_done, &step_mutex);
+        pthread_mutex_unlock(&step_mutex);
+    }
+}
+
+/* Hand off the results of the previous step and begin the next, falling back */
+/* to stepping on the calling thread if the worker can't be started.          */
+
+static void step_pipeline(GLfloat dt)
+{
+    step_join();
+
+    if (step_ran)
+        demo_swap();
+
+    if (step_started == 0)
+        step_started = (pthread_create(&step_thread, NULL, step_run, NULL) == 0);
+
+    if (step_started)
+    {
+        memcpy(step_camera.position,   position,   sizeof (position));
+        memcpy(step_camera.rotation,   rotation,   sizeof (rotation));
+        memcpy(step_camera.light,      light,      sizeof (light));
+        memcpy(step_camera.point,      point,      sizeof (point));
+        memcpy(step_camera.view,       view,       sizeof (view));
+        memcpy(step_camera.projection, projection, sizeof (projection));
+        memcpy(step_camera.vector,     vector,     sizeof (vector));
+        step_camera.zoom = zoom;
+
+        pthread_mutex_lock(&step_mutex);
+        step_dt   = dt;
+        step_busy = 1;
+        pthread_cond_signal(&step_start);
+        pthread_mutex_unlock(&step_mutex);
+    }
+    else demo_step(dt);
+
+    step_ran = 1;
+}
+
+void demo_pipeline(demo_swap_f swap)
+{
+    demo_swap = swap;
+}
+
+const GLfloat *demo_get(int token)
+{
+    const struct camera *C = camera_local();
+
+    switch (token)
+    {
+    case DEMO_POSITION:   return C ? C->position   : position;
+    case DEMO_ROTATION:   return C ? C->rotation   : rotation;
+    case DEMO_LIGHT:      return C ? C->light      : light;
+    case DEMO_POINT:      return C ? C->point      : point;
+    case DEMO_ZOOM:       return C ? &C->zoom      : &zoom;
+    case DEMO_VIEW:       return C ? C->view       : view;
+    case DEMO_PROJECTION: return C ? C->projection : projection;
+    case DEMO_DIRECTION:  return C ? C->vector     : vector;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* The job system divides the range [0, n) into one band per thread and runs  */
+/* f on each band, using a persistent pool of worker threads along with the   */
+/* calling thread. Jobs may be submitted from any thread, including the step  */
+/* worker, and concurrent submissions share the pool.                         */
 
-static GLuint clear_vert;
-static GLuint clear_frag;
-static GLuint clear;
+#define JOBS_MAX 64
 
-static struct timeval t0;
-static struct timeval t1;
+struct batch
+{
+    demo_jobs_f   f;
+    void         *d;
+    int           n;
+    int           k;
+    int           next;
+    int           done;
+    struct batch *link;
+    const struct camera *camera;
+};
+
+static pthread_mutex_t jobs_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobs_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  jobs_done   = PTHREAD_COND_INITIALIZER;
+static struct batch   *jobs_head;
+static int             jobs_width;
+
+/* Run the next band of the first batch with bands remaining. The mutex is    */
+/* held on entry and exit, but released while the band runs.                  */
+
+static void jobs_band(void)
+{
+    struct batch *B = jobs_head;
+    int           t = B->next++;
 
-static double dt;
+    if (B->next == B->k)
+        jobs_head = B->link;
 
-/*----------------------------------------------------------------------------*/
+    pthread_mutex_unlock(&jobs_mutex);
+    {
+        const struct camera *C = camera_local();
 
-static int      last_time;
+        /* Give the band the camera seen by the thread that submitted it. */
 
-/* Camera state.                                                              */
+        camera_set_local(B->camera);
 
-static GLfloat  position[4] = {   0.0,  0.0,  5.0,  1.0 };
-static GLfloat  rotation[2] = {   0.0,  0.0             };
-static GLfloat  velocity[3] = {   0.0,  0.0,  0.0       };
-static GLfloat  light[2]    = { -60.0, 30.0             };
-static GLfloat  point[4]    = {   0.0,  0.0,  0.0,  0.0 };
-static GLfloat  zoom        = 0.5;
+        B->f(B->d, (int) ((long long) B->n * (t    ) / B->k),
+                   (int) ((long long) B->n * (t + 1) / B->k));
 
-/* Camera state at the beginning of a click.                                  */
+        camera_set_local(C);
+    }
+    pthread_mutex_lock(&jobs_mutex);
 
-static int      click_modifiers;
-static int      click_button = -1;
-static int      click_x;
-static int      click_y;
-static GLfloat  click_rotation[2];
-static GLfloat  click_light[2];
-static GLfloat  click_zoom;
+    if (++B->done == B->k)
+        pthread_cond_broadcast(&jobs_done);
+}
 
-const GLfloat *demo_get(int token)
+static void *jobs_run(void *data)
 {
-    switch (token)
+    pthread_mutex_lock(&jobs_mutex);
+    for (;;)
     {
-    case DEMO_POSITION: return position;
-    case DEMO_ROTATION: return rotation;
-    case DEMO_LIGHT:    return light;
-    case DEMO_POINT:    return point;
-    case DEMO_ZOOM:     return &zoom;
+        while (jobs_head == NULL)
+            pthread_cond_wait(&jobs_queued, &jobs_mutex);
+
+        jobs_band();
+    }
+    return NULL;
+}
+
+/* Start the workers on first use, one fewer than the number of processors or */
+/* the value of the DEMO_THREADS env var. The mutex is held.                  */
+
+static void jobs_init(void)
+{
+    const char *env;
+    pthread_t   T;
+    int         n;
+
+    if ((env = getenv("DEMO_THREADS")))
+        n = atoi(env);
+    else
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > JOBS_MAX) n = JOBS_MAX;
+
+    for (jobs_width = 1; jobs_width < n; jobs_width++)
+        if (pthread_create(&T, NULL, jobs_run, NULL) == 0)
+            pthread_detach(T);
+        else
+            break;
+}
+
+void demo_jobs(demo_jobs_f f, void *d, int n)
+{
+    struct batch **p;
+    struct batch   B;
+
+    pthread_mutex_lock(&jobs_mutex);
+
+    if (jobs_width == 0)
+        jobs_init();
+
+    B.f    = f;
+    B.d    = d;
+    B.n    = n;
+    B.k    = (jobs_width < n) ? jobs_width : n;
+    B.next = 0;
+    B.done = 0;
+    B.link = NULL;
+
+    B.camera = camera_local();
+
+    if (B.k > 1)
+    {
+        /* Queue the batch and help until all of its bands are taken. */
+
+        for (p = &jobs_head; *p; p = &(*p)->link)
+            ;
+        *p = &B;
+
+        pthread_cond_broadcast(&jobs_queued);
+
+        while (B.next < B.k)
+            jobs_band();
+
+        while (B.done < B.k)
+            pthread_cond_wait(&jobs_done, &jobs_mutex);
+
+        pthread_mutex_unlock(&jobs_mutex);
+    }
+    else
+    {
+        pthread_mutex_unlock(&jobs_mutex);
+
+        if (n > 0)
+            f(d, 0, n);
     }
-    return 0;
 }
 
 /*----------------------------------------------------------------------------*/
 
-/* Write the current view state to the file named by the DEMO_STATE env var.  */
+/* The screen is cleared by drawing a dithered gradient. Buffer 0 holds a     */
+/* single triangle covering the viewport, and buffer 1 holds a pair for each  */
+/* of any number of views, each vertex giving its position and gradient       */
+/* coordinate. Vertex arrays capture their layouts where supported. Gradient  */
+/* colors are uploaded only when changed.                                     */
 
-static void state_save()
+static GLfloat  clear_top   [3] = { 0.4f, 0.4f, 0.4f };
+static GLfloat  clear_bottom[3] = { 0.2f, 0.2f, 0.2f };
+static int     *clear_list;
+static int      clear_count;
+static int      clear_w;
+static int      clear_h;
+
+static void clear_arrays(int i)
 {
-    const char *filename;
-    FILE       *file;
+    glBindBuffer(GL_ARRAY_BUFFER, clear_buffer[i]);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer  (2, GL_FLOAT, 3 * sizeof (GLfloat), (const GLvoid *) 0);
+    glTexCoordPointer(1, GL_FLOAT, 3 * sizeof (GLfloat),
+                      (const GLvoid *) (2 * sizeof (GLfloat)));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    if ((filename = getenv("DEMO_STATE")))
+static void clear_init(void)
+{
+    static const GLfloat p[3][3] = {
+        { -1.0f, -1.0f, 0.0f },
+        {  3.0f, -1.0f, 0.0f },
+        { -1.0f,  3.0f, 2.0f },
+    };
+
+    glGenBuffers(2, clear_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, clear_buffer[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof (p), p, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (GLEW_ARB_vertex_array_object)
     {
-        if ((file = fopen(filename, "w")))
-        {
-            fprintf(file, "%f %f %f %f %f %f %f %f\n",
-                position[0],
-                position[1],
-                position[2],
-                rotation[0],
-                rotation[1],
-                light[0],
-                light[1],
-                zoom);
-            fclose(file);
-        }
+        glGenVertexArrays(2, clear_array);
+
+        glBindVertexArray(clear_array[0]);
+        clear_arrays(0);
+        glBindVertexArray(clear_array[1]);
+        clear_arrays(1);
+        glBindVertexArray(0);
     }
 }
 
-/* Read the current view state from the file named by the DEMO_STATE env var. */
+static void clear_draw(int i, int n)
+{
+    if (clear_array[i])
+    {
+        glBindVertexArray(clear_array[i]);
+        glDrawArrays(GL_TRIANGLES, 0, n);
+        glBindVertexArray(0);
+    }
+    else
+    {
+        glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+        clear_arrays(i);
+        glDrawArrays(GL_TRIANGLES, 0, n);
+        glPopClientAttrib();
+    }
+}
 
-static void state_load()
+static void clear_color(GLint l, GLfloat *p, const float *c)
 {
-    const char *filename;
-    FILE       *file;
+    if (c && (p[0] != c[0] || p[1] != c[1] || p[2] != c[2]))
+    {
+        p[0] = c[0];
+        p[1] = c[1];
+        p[2] = c[2];
+        glUniform3fv(l, 1, p);
+    }
+}
 
-    if ((filename = getenv("DEMO_STATE")))
+/* Rebuild the views buffer if the views or window size have changed.        */
+
+static void clear_views(const int *v, int n)
+{
+    const size_t s = 4 * n * sizeof (int);
+
+    GLfloat *p;
+    int     *l;
+    int      i;
+
+    if (n == clear_count && clear_w == window_w
+                         && clear_h == window_h && memcmp(v, clear_list, s) == 0)
+        return;
+
+    if ((p = (GLfloat *) malloc(18 * n * sizeof (GLfloat))) &&
+        (l = (int *) realloc(clear_list, s)))
     {
-        if ((file = fopen(filename, "r")))
+        clear_list = l;
+
+        for (i = 0; i < n; ++i)
         {
-            fscanf(file, "%f %f %f %f %f %f %f %f",
-                position + 0,
-                position + 1,
-                position + 2,
-                rotation + 0,
-                rotation + 1,
-                light + 0,
-                light + 1,
-                &zoom);
-            fclose(file);
+            const GLfloat x0 = 2.0f *  v[4 * i + 0]                / window_w - 1.0f;
+            const GLfloat y0 = 2.0f *  v[4 * i + 1]                / window_h - 1.0f;
+            const GLfloat x1 = 2.0f * (v[4 * i + 0] + v[4 * i + 2]) / window_w - 1.0f;
+            const GLfloat y1 = 2.0f * (v[4 * i + 1] + v[4 * i + 3]) / window_h - 1.0f;
+
+            const GLfloat q[18] = {
+                x0, y0, 0.0f, x1, y0, 0.0f, x0, y1, 1.0f,
+                x1, y0, 0.0f, x1, y1, 1.0f, x0, y1, 1.0f,
+            };
+            memcpy(p + 18 * i, q, sizeof (q));
         }
+
+        glBindBuffer(GL_ARRAY_BUFFER, clear_buffer[1]);
+        glBufferData(GL_ARRAY_BUFFER, 18 * n * sizeof (GLfloat), p,
+                     GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        memcpy(clear_list, v, s);
+        clear_count = n;
+        clear_w     = window_w;
+        clear_h     = window_h;
     }
+    free(p);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -140,8 +1394,8 @@ static void state_load()
 static const char *clear_vert_txt = \
     "void main()                                                 \n" \
     "{                                                           \n" \
-    "    gl_TexCoord[0] = gl_Vertex * 0.5 + 0.5;                 \n" \
-    "    gl_Position    = gl_Vertex;                             \n" \
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;                     \n" \
+    "    gl_Position    = vec4(gl_Vertex.xy, 1.0, 1.0);          \n" \
     "}                                                           \n";
 
 static const char *clear_frag_txt = \
@@ -154,7 +1408,7 @@ static const char *clear_frag_txt = \
     "void main()                                                 \n" \
     "{                                                           \n" \
     "    ivec2 p = ivec2(mod(gl_FragCoord.xy - vec2(0.5), 8.0)); \n" \
-    "    vec3  c =   mix(B, T, gl_TexCoord[0].y);                \n" \
+    "    vec3  c =   mix(B, T, gl_TexCoord[0].s);                \n" \
     "    vec3  d =  vec3(A[p.x * 8 + p.y]);                      \n" \
 
     "    gl_FragColor = vec4(d + c, 1.0); \n" \
@@ -162,6 +1416,8 @@ static const char *clear_frag_txt = \
 
 static int start(int argc, char **argv)
 {
+    const char *env;
+
     /* Initialize the view and light state. */
 
     if (demo_mode == DEMO_FLY)
@@ -199,19 +1455,28 @@ static int start(int argc, char **argv)
                 0.00259427f, 0.00162896f, 0.00235294f, 0.00138763f,
                 0.00253394f, 0.00156863f, 0.00229261f, 0.00132730f
             };
-            static const GLfloat T[3] = { 0.4f, 0.4f, 0.4f };
-            static const GLfloat B[3] = { 0.2f, 0.2f, 0.2f };
+            clear_T = glGetUniformLocation(clear, "T");
+            clear_B = glGetUniformLocation(clear, "B");
 
             glUniform1fv(glGetUniformLocation(clear, "A"), 64, A);
-            glUniform3fv(glGetUniformLocation(clear, "T"),  3, T);
-            glUniform3fv(glGetUniformLocation(clear, "B"),  3, B);
+            glUniform3fv(clear_T, 1, clear_top);
+            glUniform3fv(clear_B, 1, clear_bottom);
         }
         glUseProgram(0);
+
+        clear_init();
     }
 
     /* Initialize the demo's internal state. */
 
-    gettimeofday(&t0, 0);
+    if ((env = getenv("DEMO_TIMESTEP")))
+        timestep = atof(env);
+
+    tracing   = (getenv("DEMO_TRACE") != NULL);
+    last_time = now();
+    t0        = last_time;
+
+    path_init();
 
     if (demo_init)
         return demo_init(argc, argv);
@@ -219,17 +1484,33 @@ static int start(int argc, char **argv)
         return 1;
 }
 
-static int close()
+static int finish()
 {
+    step_join();
+
     if (demo_quit)
         demo_quit();
 
+    if (clear_array[0])
+        glDeleteVertexArrays(2, clear_array);
+
+    glDeleteBuffers(2, clear_buffer);
     glDeleteProgram(clear);
     glDeleteShader(clear_frag);
     glDeleteShader(clear_vert);
 
+    capture_stop();
+    trace_write();
+    path_free();
+    free(clear_list);
     state_save();
 
+    if (headless_fbo)
+    {
+        glDeleteFramebuffers (1, &headless_fbo);
+        glDeleteRenderbuffers(2,  headless_rbo);
+    }
+
     exit(0);
 }
 
@@ -240,80 +1521,66 @@ void demo_clear(const float *T, const float *B)
     if (clear)
     {
         glPushAttrib(GL_DEPTH_BUFFER_BIT);
-        glEnableClientState(GL_VERTEX_ARRAY);
-        {
-            static const GLfloat p[4][4] = {
-                { -1.0f, -1.0f,  1.0f,  1.0f },
-                {  1.0f, -1.0f,  1.0f,  1.0f },
-                { -1.0f,  1.0f,  1.0f,  1.0f },
-                {  1.0f,  1.0f,  1.0f,  1.0f },
-            };
-
-            glDisable(GL_DEPTH_TEST);
+        glDisable(GL_DEPTH_TEST);
 
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-            glVertexPointer(4, GL_FLOAT, 0, p);
-
-            glUseProgram(clear);
-            {
-                if (T) glUniform3fv(glGetUniformLocation(clear, "T"), 3, T);
-                if (B) glUniform3fv(glGetUniformLocation(clear, "B"), 3, B);
-                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-            }
-            glUseProgram(0);
+        glUseProgram(clear);
+        {
+            clear_color(clear_T, clear_top,    T);
+            clear_color(clear_B, clear_bottom, B);
+            clear_draw(0, 3);
         }
-        glDisableClientState(GL_VERTEX_ARRAY);
+        glUseProgram(0);
+
         glPopAttrib();
     }
     else glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 }
 
-/*----------------------------------------------------------------------------*/
+/* Clear n viewports at once, each given by x, y, w, h in window coordinates. */
 
-static void camera_fly(void)
+void demo_clear_views(const float *T, const float *B, const int *v, int n)
 {
-    glRotatef(rotation[0], 1.0f, 0.0f, 0.0f);
-    glRotatef(rotation[1], 0.0f, 1.0f, 0.0f);
-    glTranslatef(-position[0], -position[1], -position[2]);
-}
+    int i;
 
-static void camera_dolly(void)
-{
-    glTranslatef(0.0f, 0.0f, -position[2]);
-}
+    if (clear && n > 0)
+    {
+        clear_views(v, n);
 
-static void camera_tumble(void)
-{
-    glTranslatef(-position[0], -position[1], -position[2]);
-    glRotatef(rotation[0], 1.0f, 0.0f, 0.0f);
-    glRotatef(rotation[1], 0.0f, 1.0f, 0.0f);
-}
+        glPushAttrib(GL_DEPTH_BUFFER_BIT | GL_VIEWPORT_BIT);
+        glDisable(GL_DEPTH_TEST);
+        glViewport(0, 0, window_w, window_h);
 
-static void camera(void)
-{
-    /* Apply the camera transformation. */
+        glUseProgram(clear);
+        {
+            clear_color(clear_T, clear_top,    T);
+            clear_color(clear_B, clear_bottom, B);
+            clear_draw(1, 6 * n);
+        }
+        glUseProgram(0);
 
-    switch (demo_mode)
+        glPopAttrib();
+    }
+    else
     {
-    case DEMO_FLY:    camera_fly();    break;
-    case DEMO_DOLLY:  camera_dolly();  break;
-    case DEMO_TUMBLE: camera_tumble(); break;
+        glPushAttrib(GL_SCISSOR_BIT);
+        glEnable(GL_SCISSOR_TEST);
+
+        for (i = 0; i < n; ++i)
+        {
+            glScissor(v[4 * i + 0], v[4 * i + 1], v[4 * i + 2], v[4 * i + 3]);
+            glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+        }
+        glPopAttrib();
     }
 }
 
+/*----------------------------------------------------------------------------*/
+
 static void lights()
 {
     /* Position the global light. */
 
-    const GLfloat L[4] = { 0.0f, 0.0f, 1.0f, 0.0f };
-
-    glPushMatrix();
-    {
-        glRotatef(light[1], 0.0f, 1.0f, 0.0f);
-        glRotatef(light[0], 1.0f, 0.0f, 0.0f);
-        glLightfv(GL_LIGHT0, GL_POSITION, L);
-    }
-    glPopMatrix();
+    glLightfv(GL_LIGHT0, GL_POSITION, vector);
 
     /* Position the flashlight. */
 
@@ -359,27 +1626,14 @@ static void zoom_camera(GLfloat dy)
 
 /*----------------------------------------------------------------------------*/
 
-static void snap(void)
-{
-    int   w = glutGet(GLUT_WINDOW_WIDTH);
-    int   h = glutGet(GLUT_WINDOW_HEIGHT);
-    void *p;
-
-    if ((p = malloc(w * h * 4)))
-    {
-        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, p);
-        image_flip (           w, h, 4, 1, p);
-        image_write("out.png", w, h, 4, 1, p);
-        free(p);
-    }
-}
-
 static void tilt(void)
 {
     velocity[0] = 0.f;
     velocity[1] = 0.f;
     velocity[2] = 0.f;
 
+    step_join();
+
     if (demo_tilt)
         demo_tilt();
 }
@@ -396,9 +1650,11 @@ static void keyboardup(unsigned char key, int x, int y)
         case 'w': case ',': velocity[2] += 1.0; break;
         case 's': case 'o': velocity[2] -= 1.0; break;
 
+        case 'r': case 'p': record(); break;
+
         case  9: tilt();  break;
         case 13: snap();  break;
-        case 27: close(); break;
+        case 27: finish(); break;
     }
 }
 
@@ -419,8 +1675,8 @@ static void keyboard(unsigned char key, int x, int y)
 
 static void motion(int x, int y)
 {
-    const int w = glutGet(GLUT_WINDOW_WIDTH);
-    const int h = glutGet(GLUT_WINDOW_HEIGHT);
+    const int w = window_w;
+    const int h = window_h;
 
     GLfloat H = 0.1f * zoom * w / h;
     GLfloat V = 0.1f * zoom;
@@ -478,65 +1734,84 @@ static void mouse(int button, int state, int x, int y)
 static void perf()
 {
     char   str[256];
-    double ft;
-
-    /* Compute the frame time. */
-
-    gettimeofday(&t1, 0);
+    double t1 = now();
+    double ft = t1 - t0;
 
-    ft = (t1.tv_sec  - t0.tv_sec) +
-         (t1.tv_usec - t0.tv_usec) / 1000000.0;
+    /* Compute the frame time and record the frame. */
 
     dt = (dt * 15.0 + ft) / 16.0;
     t0 = t1;
 
+    current.frame = ft * 1000.0;
+    trace_commit();
+
     /* Display it in the window title. */
 
-    sprintf(str, "%5.2f ms %4d fps\n", (1000.0 * dt), (int) (1.0 / dt));
-    glutSetWindowTitle(str);
+    if (headless == 0)
+    {
+        sprintf(str, "%5.2f ms %4d fps\n", (1000.0 * dt), (int) (1.0 / dt));
+        glutSetWindowTitle(str);
+    }
 }
 
 static void reshape(int w, int h)
 {
+    window_w = w;
+    window_h = h;
     glViewport(0, 0, w, h);
 }
 
 static void display(void)
 {
-    /* Initialize the projection and model-view matrices. */
+    double t1;
+    double t2;
+    double t3;
 
-    GLfloat V = 0.1f * zoom;
-    GLfloat H = 0.1f * zoom * glutGet(GLUT_WINDOW_WIDTH)
-                            / glutGet(GLUT_WINDOW_HEIGHT);
+    /* Load the projection and model-view matrices. */
+
+    transform();
 
     glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glFrustum(-H, H, -V, V, 0.1, 100.0);
+    glLoadMatrixf(projection);
 
     glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    glLoadMatrixf(view);
+
+    /* Draw the scene, timing it on both the CPU and GPU. */
+
+    t1 = now();
+    query_begin();
+    {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    /* Draw the scene. */
+        lights();
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        if (demo_draw)
+            demo_draw();
+    }
+    query_end();
+    t2 = now();
+
+    capture(window_w, window_h);
 
-    camera();
-    lights();
+    if (headless == 0)
+        glutSwapBuffers();
 
-    if (demo_draw)
-        demo_draw();
+    t3 = now();
+
+    current.draw = (t2 - t1) * 1000.0;
+    current.swap = (t3 - t2) * 1000.0;
 
-    glutSwapBuffers();
     perf();
 }
 
 /*----------------------------------------------------------------------------*/
 
-static void idle(void)
-{
-    int curr_time = glutGet(GLUT_ELAPSED_TIME);
+/* Advance the camera and the demo by dt seconds.                             */
 
-    GLfloat speed = 3.0f, dt = (curr_time - last_time) / 1000.0f;
+static void advance(GLfloat dt)
+{
+    GLfloat speed = 3.0f;
 
     /* Compute the position change from the speed, time, and velocity. */
 
@@ -550,9 +1825,9 @@ static void idle(void)
 
     if (demo_mode == DEMO_FLY)
     {
-        GLfloat M[16];
+        const GLfloat *M = view;
 
-        glGetFloatv(GL_MODELVIEW_MATRIX, M);
+        transform();
 
         position[0] += M[ 0] * v[0] + M[ 1] * v[1] + M[ 2] * v[2];
         position[1] += M[ 4] * v[0] + M[ 5] * v[1] + M[ 6] * v[2];
@@ -565,21 +1840,159 @@ static void idle(void)
         position[2] += v[2];
     }
 
-    /* Step the demo as needed. */
+    /* Follow or record the camera path, ending at the end of the path. */
+
+    if (path_step(dt) == 0)
+        finish();
+
+    /* Step the demo as needed, overlapping with drawing if pipelined. */
 
     if (demo_step)
-        demo_step(dt);
+    {
+        if (demo_swap)
+            step_pipeline(dt);
+        else
+            demo_step(dt);
+    }
+}
+
+/* Advance by the time elapsed since the last step, or by the fixed timestep */
+/* given by the DEMO_TIMESTEP env var, for reproducible runs.                 */
+
+static void idle(void)
+{
+    double curr_time = now();
+
+    advance(timestep > 0.0 ? timestep : curr_time - last_time);
 
     glutPostRedisplay();
 
-    last_time = curr_time;
+    current.step = (now() - curr_time) * 1000.0;
+    last_time    = curr_time;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* In headless mode, an OpenGL context is created using EGL with no window    */
+/* system, preferring Mesa's surfaceless platform, and rendering targets a    */
+/* framebuffer object of the requested size. This allows batch rendering and  */
+/* automated testing on machines with no display or GPU.                      */
+
+static int headless_context(void)
+{
+#ifndef CONFIG_NO_EGL
+    static const EGLint attr[] = {
+        EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE,        8,
+        EGL_GREEN_SIZE,      8,
+        EGL_BLUE_SIZE,       8,
+        EGL_ALPHA_SIZE,      8,
+        EGL_NONE
+    };
+    static const EGLint size[] = {
+        EGL_WIDTH,  1,
+        EGL_HEIGHT, 1,
+        EGL_NONE
+    };
+
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLSurface surface;
+    EGLContext context;
+    EGLConfig  config;
+    EGLint     n;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+                                 eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get)
+        display = get(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+    {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+            return 0;
+    }
+
+    if (eglChooseConfig(display, attr, &config, 1, &n) && n == 1 &&
+        eglBindAPI(EGL_OPENGL_API))
+    {
+        surface = eglCreatePbufferSurface(display, config, size);
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+
+        if (surface != EGL_NO_SURFACE && context != EGL_NO_CONTEXT)
+            return eglMakeCurrent(display, surface, surface, context);
+    }
+#endif
+    return 0;
+}
+
+static int headless_target(int w, int h)
+{
+    glGenFramebuffers (1, &headless_fbo);
+    glGenRenderbuffers(2,  headless_rbo);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, headless_rbo[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless_rbo[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, headless_fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, headless_rbo[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, headless_rbo[1]);
+
+    reshape(w, h);
+
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+/* Render n frames at a fixed rate. Record all of them if DEMO_RECORD is set, */
+/* or otherwise snap the last.                                                */
+
+static void headless_run(int n)
+{
+    double t;
+    int    i;
+
+    recording = (getenv("DEMO_RECORD") != NULL);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (i == n - 1 && recording == 0)
+            snap_pending = 1;
+
+        t = now();
+        advance(timestep > 0.0 ? timestep : 1.0 / 60.0);
+        current.step = (now() - t) * 1000.0;
+        display();
+    }
 }
 
 /*----------------------------------------------------------------------------*/
 
+/* GLEW built for GLX reports the absence of an X display, though all OpenGL */
+/* entry points load successfully in a headless context.                      */
+
+static int init_glew(void)
+{
+    GLenum e = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (headless && e == GLEW_ERROR_NO_GLX_DISPLAY)
+        return 1;
+#endif
+    return (e == GLEW_OK);
+}
+
 int demo(int mode, int argc, char *argv[], demo_init_f init, demo_tilt_f tilt,
                          demo_quit_f quit, demo_draw_f draw, demo_step_f step)
 {
+    const char *spec;
+
     demo_mode = mode;
     demo_init = init;
     demo_tilt = tilt;
@@ -587,6 +2000,32 @@ int demo(int mode, int argc, char *argv[], demo_init_f init, demo_tilt_f tilt,
     demo_draw = draw;
     demo_step = step;
 
+    /* Render offscreen if requested, with the size and frame count given. */
+
+    if ((spec = getenv("DEMO_HEADLESS")))
+    {
+        int w = window_w;
+        int h = window_h;
+        int n = 1;
+
+        sscanf(spec, "%dx%dx%d", &w, &h, &n);
+
+        headless = 1;
+
+        if (w > 0 && h > 0 && headless_context() && init_glew()
+                                                 && headless_target(w, h))
+        {
+            if (start(argc, argv))
+            {
+                headless_run(n);
+                finish();
+            }
+        }
+        else fprintf(stderr, "demo: Headless OpenGL context unavailable\n");
+
+        return 0;
+    }
+
     glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE);
     glutInitWindowSize(1024, 768);
     glutInit(&argc, argv);
@@ -604,7 +2043,7 @@ int demo(int mode, int argc, char *argv[], demo_init_f init, demo_tilt_f tilt,
 
     glutIgnoreKeyRepeat(1);
 
-    if (glewInit() == GLEW_OK)
+    if (init_glew())
     {
         if (start(argc, argv))
             glutMainLoop();
@@ -32,6 +32,8 @@ typedef void (*demo_tilt_f)(void);
 typedef void (*demo_quit_f)(void);
 typedef void (*demo_draw_f)(void);
 typedef void (*demo_step_f)(float);
+typedef void (*demo_swap_f)(void);
+typedef void (*demo_jobs_f)(void *, int, int);
 
 /*----------------------------------------------------------------------------*/
 
@@ -47,14 +49,21 @@ enum {
     DEMO_ROTATION,
     DEMO_LIGHT,
     DEMO_POINT,
-    DEMO_ZOOM
+    DEMO_ZOOM,
+    DEMO_VIEW,
+    DEMO_PROJECTION,
+    DEMO_DIRECTION
 };
 
 int demo(int, int, char **, demo_init_f, demo_tilt_f, demo_quit_f,
                                          demo_draw_f, demo_step_f);
 const float *demo_get(int);
 
+void demo_pipeline(demo_swap_f);
+void demo_jobs(demo_jobs_f, void *, int);
+
 void demo_clear(const float *, const float *);
+void demo_clear_views(const float *, const float *, const int *, int);
 
 /*----------------------------------------------------------------------------*/
 
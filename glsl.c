@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "glsl.h"
 
@@ -124,17 +125,598 @@ int check_program_log(GLuint program)
 
 /*----------------------------------------------------------------------------*/
 
+static char *cache_path = 0;
+
+void glsl_cache_dir(const char *dir)
+{
+    /* Set the program binary cache directory, or null to disable caching. */
+
+    free(cache_path);
+    cache_path = dir ? copy_str(dir) : 0;
+}
+
+static int cache_usable(void)
+{
+    return cache_path && GLEW_ARB_get_program_binary;
+}
+
+static unsigned long long fnv(unsigned long long k, const void *p, size_t n)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    size_t               i;
+
+    for (i = 0; i < n; ++i)
+        k = (k ^ u[i]) * 1099511628211ULL;
+
+    return k;
+}
+
+static unsigned long long cache_key(const char *vert_str, int vert_len,
+                                    const char *frag_str, int frag_len)
+{
+    static const GLenum e[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+
+    unsigned long long k = 14695981039346656037ULL;
+    const GLubyte     *s;
+    int                i;
+
+    /* Hash the source, and the driver that would compile it. */
+
+    k = fnv(k, vert_str, vert_len < 0 ? strlen(vert_str) : (size_t) vert_len);
+    k = fnv(k, "", 1);
+    k = fnv(k, frag_str, frag_len < 0 ? strlen(frag_str) : (size_t) frag_len);
+    k = fnv(k, "", 1);
+
+    for (i = 0; i < 3; ++i)
+        if ((s = glGetString(e[i])))
+            k = fnv(k, s, strlen((const char *) s) + 1);
+
+    return k;
+}
+
+static char *cache_file(unsigned long long k, const char *ext)
+{
+    size_t n = strlen(cache_path) + 32;
+    char  *s = 0;
+
+    if ((s = (char *) malloc(n)))
+        snprintf(s, n, "%s/%016llx.%s", cache_path, k, ext);
+
+    return s;
+}
+
+static int cache_format(GLenum f)
+{
+    GLint *v = 0;
+    GLint  n = 0;
+    GLint  i;
+    int    r = 0;
+
+    /* Determine whether the driver supports binary format f. */
+
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n);
+
+    if (n > 0 && (v = (GLint *) calloc(n, sizeof (GLint))))
+    {
+        glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, v);
+
+        for (i = 0; i < n; ++i)
+            if ((GLenum) v[i] == f)
+                r = 1;
+
+        free(v);
+    }
+    return r;
+}
+
+static GLuint cache_load(unsigned long long k)
+{
+    GLuint program = 0;
+    GLint  status  = 0;
+    GLint  d[3];
+    FILE  *fp = 0;
+    char  *s  = 0;
+    void  *p  = 0;
+
+    /* Load the program binary with the given key, and confirm that the      */
+    /* driver accepts it. An updated driver may reject an older binary.      */
+
+    if ((s = cache_file(k, "bin")))
+    {
+        if ((fp = fopen(s, "rb")))
+        {
+            if (fread(d, sizeof (GLint), 3, fp) == 3 && d[0] == 0x4c534c47
+                             && d[2] > 0 && cache_format((GLenum) d[1]))
+            {
+                if ((p = malloc((size_t) d[2])))
+                {
+                    if (fread(p, 1, (size_t) d[2], fp) == (size_t) d[2])
+                    {
+                        program = glCreateProgram();
+
+                        glProgramBinary(program, (GLenum) d[1], p, d[2]);
+                        glGetProgramiv (program, GL_LINK_STATUS, &status);
+
+                        if (status == 0)
+                        {
+                            glDeleteProgram(program);
+                            program = 0;
+                        }
+                    }
+                    free(p);
+                }
+            }
+            fclose(fp);
+        }
+        free(s);
+    }
+    return program;
+}
+
+static void cache_store(unsigned long long k, GLuint program)
+{
+    GLint  d[3];
+    GLenum f = 0;
+    FILE  *fp = 0;
+    char  *s  = 0;
+    char  *t  = 0;
+    void  *p  = 0;
+    int    ok = 0;
+    char   e[32];
+
+    /* Store the program binary under a temporary name unique to this         */
+    /* process, then rename it, so that concurrent runs never see a partial   */
+    /* file.                                                                  */
+
+    sprintf(e, "%d.tmp", (int) getpid());
+
+    d[0] = 0x4c534c47;
+    d[2] = 0;
+
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, d + 2);
+
+    if (d[2] > 0 && (p = malloc((size_t) d[2])))
+    {
+        glGetProgramBinary(program, d[2], d + 2, &f, p);
+        d[1] = (GLint) f;
+
+        if (d[2] > 0 && (s = cache_file(k, "bin"))
+                     && (t = cache_file(k, e)))
+        {
+            if ((fp = fopen(t, "wb")))
+            {
+                ok = (fwrite(d, sizeof (GLint), 3, fp) == 3 &&
+                      fwrite(p, 1, (size_t) d[2], fp) == (size_t) d[2]);
+
+                if (fclose(fp) == 0 && ok)
+                    rename(t, s);
+                else
+                    remove(t);
+            }
+        }
+        free(t);
+        free(s);
+        free(p);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Each program's active uniforms and attributes are listed once after link, */
+/* and found by name using a hash table. Each uniform shadows its current     */
+/* value so that redundant uploads are skipped. Array uniforms are listed by  */
+/* name, and by the name of each element, with each element's value aliasing */
+/* that of the array.                                                         */
+
+struct glsl_var
+{
+    char    *name;
+    unsigned hash;
+    int      attrib;
+    GLint    loc;
+    GLenum   type;
+    GLint    count;
+    int      kind;
+    int      size;
+    GLint   *value;
+};
+
+enum { KIND_FLOAT, KIND_INT, KIND_UINT, KIND_NONE };
+
+static unsigned hash_str(const char *s)
+{
+    unsigned k = 2166136261U;
+
+    while (*s)
+        k = (k ^ (unsigned char) *s++) * 16777619U;
+
+    return k;
+}
+
+static int type_size(GLenum type, int *kind)
+{
+    /* Give the number of components of the given type, and their kind. */
+
+    *kind = KIND_FLOAT;
+
+    switch (type)
+    {
+    case GL_FLOAT:             return 1;
+    case GL_FLOAT_VEC2:        return 2;
+    case GL_FLOAT_VEC3:        return 3;
+    case GL_FLOAT_VEC4:        return 4;
+    case GL_FLOAT_MAT2:        return 4;
+    case GL_FLOAT_MAT3:        return 9;
+    case GL_FLOAT_MAT4:        return 16;
+    case GL_FLOAT_MAT2x3:      return 6;
+    case GL_FLOAT_MAT2x4:      return 8;
+    case GL_FLOAT_MAT3x2:      return 6;
+    case GL_FLOAT_MAT3x4:      return 12;
+    case GL_FLOAT_MAT4x2:      return 8;
+    case GL_FLOAT_MAT4x3:      return 12;
+    }
+
+    *kind = KIND_UINT;
+
+    switch (type)
+    {
+    case GL_UNSIGNED_INT:      return 1;
+    case GL_UNSIGNED_INT_VEC2: return 2;
+    case GL_UNSIGNED_INT_VEC3: return 3;
+    case GL_UNSIGNED_INT_VEC4: return 4;
+    }
+
+    *kind = KIND_NONE;
+
+    switch (type)
+    {
+    case GL_DOUBLE:
+    case GL_DOUBLE_VEC2:
+    case GL_DOUBLE_VEC3:
+    case GL_DOUBLE_VEC4:
+    case GL_DOUBLE_MAT2:
+    case GL_DOUBLE_MAT3:
+    case GL_DOUBLE_MAT4:       return 0;
+    }
+
+    /* All others, including samplers, are given as integers. */
+
+    *kind = KIND_INT;
+
+    switch (type)
+    {
+    case GL_INT_VEC2:
+    case GL_BOOL_VEC2:         return 2;
+    case GL_INT_VEC3:
+    case GL_BOOL_VEC3:         return 3;
+    case GL_INT_VEC4:
+    case GL_BOOL_VEC4:         return 4;
+    }
+    return 1;
+}
+
+static void table_clear(glsl *G)
+{
+    G->vars       = 0;
+    G->index      = 0;
+    G->values     = 0;
+    G->var_count  = 0;
+    G->index_size = 0;
+}
+
+static void table_free(glsl *G)
+{
+    int i;
+
+    for (i = 0; i < G->var_count; ++i)
+        free(G->vars[i].name);
+
+    free(G->values);
+    free(G->index);
+    free(G->vars);
+
+    table_clear(G);
+}
+
+static struct glsl_var *table_add(glsl *G, const char *name, int attrib,
+                                  GLint loc, GLenum type, GLint count)
+{
+    struct glsl_var *V = G->vars + G->var_count;
+    unsigned         i;
+
+    /* Add a variable and index it using linear probing. */
+
+    V->name   = copy_str(name);
+    V->hash   = hash_str(name);
+    V->attrib = attrib;
+    V->loc    = loc;
+    V->type   = type;
+    V->count  = count;
+    V->size   = type_size(type, &V->kind);
+    V->value  = 0;
+
+    for (i = V->hash; G->index[i & (G->index_size - 1)] >= 0; ++i)
+        ;
+
+    G->index[i & (G->index_size - 1)] = G->var_count++;
+
+    return V;
+}
+
+static void table_read(glsl *G, struct glsl_var *V)
+{
+    /* Read the current value of a uniform into its shadow. */
+
+    if (V->loc >= 0)
+        switch (V->kind)
+        {
+        case KIND_FLOAT:
+            glGetUniformfv (G->program, V->loc, (GLfloat *) V->value); break;
+        case KIND_INT:
+            glGetUniformiv (G->program, V->loc, (GLint   *) V->value); break;
+        case KIND_UINT:
+            glGetUniformuiv(G->program, V->loc, (GLuint  *) V->value); break;
+        }
+}
+
+static void table_init(glsl *G)
+{
+    struct glsl_var *V;
+
+    GLint   nu = 0, lu = 0;
+    GLint   na = 0, la = 0;
+    GLint   n  = 0;
+    GLint   m  = 0;
+    GLint   s;
+    GLenum  t;
+    GLchar *str = 0;
+    GLchar *tmp = 0;
+    GLint   i;
+    GLint   j;
+    int     k;
+
+    table_clear(G);
+
+    glGetProgramiv(G->program, GL_ACTIVE_UNIFORMS,             &nu);
+    glGetProgramiv(G->program, GL_ACTIVE_UNIFORM_MAX_LENGTH,   &lu);
+    glGetProgramiv(G->program, GL_ACTIVE_ATTRIBUTES,           &na);
+    glGetProgramiv(G->program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &la);
+
+    if (lu < la)
+        lu = la;
+
+    if ((str = (GLchar *) calloc(lu + 16, 1)) == 0 ||
+        (tmp = (GLchar *) calloc(lu + 16, 1)) == 0)
+    {
+        free(str);
+        return;
+    }
+
+    /* Count the variables and the total size of their values. */
+
+    for (i = 0; i < nu; ++i)
+    {
+        glGetActiveUniform(G->program, i, lu, NULL, &s, &t, str);
+
+        n += (s > 1) ? s + 1 : 1;
+        m +=  s * type_size(t, &k);
+    }
+    n += na;
+
+    /* Allocate the variables, values, and a half-full index. */
+
+    for (G->index_size = 8; G->index_size < 2 * n; G->index_size *= 2)
+        ;
+
+    G->vars   = (struct glsl_var *) calloc(n + 1, sizeof (struct glsl_var));
+    G->values = (GLint           *) calloc(m + 1, sizeof (GLint));
+    G->index  = (int             *) malloc(G->index_size * sizeof (int));
+
+    if (G->vars && G->values && G->index)
+    {
+        memset(G->index, 0xFF, G->index_size * sizeof (int));
+
+        /* List each uniform, and each element of each uniform array. */
+
+        for (m = 0, i = 0; i < nu; ++i)
+        {
+            GLint *p = G->values + m;
+            char  *b;
+
+            glGetActiveUniform(G->program, i, lu, NULL, &s, &t, str);
+
+            if ((b = strstr(str, "[0]")) && b[3] == 0)
+                *b = 0;
+
+            V = table_add(G, str, 0, glGetUniformLocation(G->program, str),
+                          t, s);
+            V->value = p;
+            m += s * V->size;
+
+            if (s > 1)
+            {
+                for (j = 0; j < s; ++j)
+                {
+                    sprintf(tmp, "%s[%d]", str, j);
+
+                    V = table_add(G, tmp, 0,
+                                  glGetUniformLocation(G->program, tmp),
+                                  t, s - j);
+                    V->value = p + j * V->size;
+
+                    table_read(G, V);
+                }
+            }
+            else table_read(G, V);
+        }
+
+        /* List each attribute. */
+
+        for (i = 0; i < na; ++i)
+        {
+            glGetActiveAttrib(G->program, i, lu, NULL, &s, &t, str);
+            table_add(G, str, 1, glGetAttribLocation(G->program, str), t, s);
+        }
+    }
+    else table_free(G);
+
+    free(tmp);
+    free(str);
+}
+
+static struct glsl_var *table_find(glsl *G, const char *name, int attrib)
+{
+    const unsigned h = hash_str(name);
+
+    struct glsl_var *V;
+    unsigned         i;
+
+    if (G->index)
+        for (i = h; G->index[i & (G->index_size - 1)] >= 0; ++i)
+        {
+            V = G->vars + G->index[i & (G->index_size - 1)];
+
+            if (V->hash == h && V->attrib == attrib && !strcmp(V->name, name))
+                return V;
+        }
+
+    return 0;
+}
+
+static void table_set(glsl *G, const char *name, GLsizei n, const void *v,
+                      int kind, int scalar)
+{
+    struct glsl_var *V;
+    size_t           s;
+
+    /* Upload the value only if it differs from the shadow. */
+
+    if ((V = table_find(G, name, 0)) && V->loc >= 0 && V->kind == kind
+                                     && (V->size == 1 || scalar == 0))
+    {
+        if (n > V->count)
+            n = V->count;
+
+        s = (size_t) n * V->size * sizeof (GLint);
+
+        if (memcmp(V->value, v, s))
+        {
+            memcpy(V->value, v, s);
+
+            switch (V->type)
+            {
+            case GL_FLOAT:             glUniform1fv(V->loc, n, (const GLfloat *) v); break;
+            case GL_FLOAT_VEC2:        glUniform2fv(V->loc, n, (const GLfloat *) v); break;
+            case GL_FLOAT_VEC3:        glUniform3fv(V->loc, n, (const GLfloat *) v); break;
+            case GL_FLOAT_VEC4:        glUniform4fv(V->loc, n, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT2:        glUniformMatrix2fv  (V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT3:        glUniformMatrix3fv  (V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT4:        glUniformMatrix4fv  (V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT2x3:      glUniformMatrix2x3fv(V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT2x4:      glUniformMatrix2x4fv(V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT3x2:      glUniformMatrix3x2fv(V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT3x4:      glUniformMatrix3x4fv(V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT4x2:      glUniformMatrix4x2fv(V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_FLOAT_MAT4x3:      glUniformMatrix4x3fv(V->loc, n, GL_FALSE, (const GLfloat *) v); break;
+            case GL_UNSIGNED_INT:      glUniform1uiv(V->loc, n, (const GLuint *) v); break;
+            case GL_UNSIGNED_INT_VEC2: glUniform2uiv(V->loc, n, (const GLuint *) v); break;
+            case GL_UNSIGNED_INT_VEC3: glUniform3uiv(V->loc, n, (const GLuint *) v); break;
+            case GL_UNSIGNED_INT_VEC4: glUniform4uiv(V->loc, n, (const GLuint *) v); break;
+            default:
+                switch (V->size)
+                {
+                case 1: glUniform1iv(V->loc, n, (const GLint *) v); break;
+                case 2: glUniform2iv(V->loc, n, (const GLint *) v); break;
+                case 3: glUniform3iv(V->loc, n, (const GLint *) v); break;
+                case 4: glUniform4iv(V->loc, n, (const GLint *) v); break;
+                }
+            }
+        }
+    }
+}
+
+GLint glsl_uniform_location(glsl *G, const char *name)
+{
+    struct glsl_var *V = table_find(G, name, 0);
+    return V ? V->loc : -1;
+}
+
+GLint glsl_attrib_location(glsl *G, const char *name)
+{
+    struct glsl_var *V = table_find(G, name, 1);
+    return V ? V->loc : -1;
+}
+
+void glsl_uniformfv(glsl *G, const char *name, GLsizei n, const GLfloat *v)
+{
+    table_set(G, name, n, v, KIND_FLOAT, 0);
+}
+
+void glsl_uniformiv(glsl *G, const char *name, GLsizei n, const GLint *v)
+{
+    table_set(G, name, n, v, KIND_INT, 0);
+}
+
+void glsl_uniformuiv(glsl *G, const char *name, GLsizei n, const GLuint *v)
+{
+    table_set(G, name, n, v, KIND_UINT, 0);
+}
+
+void glsl_uniformf(glsl *G, const char *name, GLfloat f)
+{
+    table_set(G, name, 1, &f, KIND_FLOAT, 1);
+}
+
+void glsl_uniformi(glsl *G, const char *name, GLint i)
+{
+    table_set(G, name, 1, &i, KIND_INT, 1);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static GLuint compile_shader(GLenum type, const char *str, int len)
+{
+    /* Begin compiling a new shader with the given source. */
+
+    GLuint shader = glCreateShader(type);
+
+    glShaderSource (shader, 1, (const GLchar **) &str,
+                               (const GLint  *)  &len);
+    glCompileShader(shader);
+
+    return shader;
+}
+
+static GLuint link_program(GLuint shader_vert,
+                           GLuint shader_frag)
+{
+    /* Begin linking a new program object. */
+
+    GLuint program = glCreateProgram();
+
+    glBindAttribLocation(program, 6, "my_Tangent");
+
+    /* Allow the linked binary to be cached. */
+
+    if (cache_usable())
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                                     GL_TRUE);
+
+    glAttachShader(program, shader_vert);
+    glAttachShader(program, shader_frag);
+
+    glLinkProgram(program);
+
+    return program;
+}
+
 GLuint glsl_init_shader(GLenum type, const char *str, int len)
 {
     if (str)
     {
         /* Compile a new shader with the given source. */
 
-        GLuint shader = glCreateShader(type);
-
-        glShaderSource (shader, 1, (const GLchar **) &str,
-                                   (const GLint  *)  &len);
-        glCompileShader(shader);
+        GLuint shader = compile_shader(type, str, len);
 
         /* If the shader is valid, return it.  Else, delete it. */
 
@@ -154,14 +736,7 @@ GLuint glsl_init_program(GLuint shader_vert,
 {
     /* Link a new program object. */
 
-    GLuint program = glCreateProgram();
-
-    glBindAttribLocation(program, 6, "my_Tangent");
-
-    glAttachShader(program, shader_vert);
-    glAttachShader(program, shader_frag);
-
-    glLinkProgram(program);
+    GLuint program = link_program(shader_vert, shader_frag);
 
     /* If the program is valid, return it.  Else, delete it. */
 
@@ -175,34 +750,173 @@ GLuint glsl_init_program(GLuint shader_vert,
 
 /*----------------------------------------------------------------------------*/
 
-GLboolean glsl_source(glsl *G, const char *vert_str, int vert_len,
-                               const char *frag_str, int frag_len)
+static int parallel_usable(void)
 {
+    static int init = 0;
+
+    /* Let the driver compile on as many threads as it likes. */
+
+    if (GLEW_KHR_parallel_shader_compile)
+    {
+        if (init == 0)
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        init = 1;
+        return 1;
+    }
+    if (GLEW_ARB_parallel_shader_compile)
+    {
+        if (init == 0)
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+        init = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static GLboolean glsl_submit(glsl *G, const char *vert_str, int vert_len,
+                                      const char *frag_str, int frag_len)
+{
+    G->vert_shader = 0;
+    G->frag_shader = 0;
+    G->program     = 0;
+    G->pending     = 0;
+    G->key         = 0;
+
+    table_clear(G);
+
     if (vert_str && frag_str)
     {
-        /* Compile the shaders. */
+        /* Use the cached program binary, if any. */
 
-        G->vert_filename = NULL;
-        G->frag_filename = NULL;
+        if (cache_usable())
+        {
+            G->key = cache_key(vert_str, vert_len, frag_str, frag_len);
 
-        G->vert_shader = glsl_init_shader(GL_VERTEX_SHADER,   vert_str,
-                                                        (int) vert_len);
-        G->frag_shader = glsl_init_shader(GL_FRAGMENT_SHADER, frag_str,
-                                                        (int) frag_len);
+            if ((G->program = cache_load(G->key)))
+            {
+                table_init(G);
+                return GL_TRUE;
+            }
+        }
 
-        /* Link the program. */
+        /* Begin compiling the shaders and linking the program, but don't   */
+        /* query their status, which would wait for the driver to finish.   */
 
-        if (G->vert_shader && G->frag_shader)
+        parallel_usable();
+
+        G->vert_shader = compile_shader(GL_VERTEX_SHADER,   vert_str, vert_len);
+        G->frag_shader = compile_shader(GL_FRAGMENT_SHADER, frag_str, frag_len);
+        G->program     = link_program(G->vert_shader, G->frag_shader);
+        G->pending     = 1;
+
+        return GL_TRUE;
+    }
+    return GL_FALSE;
+}
+
+static void print_source(GLuint shader)
+{
+    GLchar *p = 0;
+    GLint   n = 0;
+
+    /* Print the source of a failed shader. */
+
+    glGetShaderiv(shader, GL_SHADER_SOURCE_LENGTH, &n);
+
+    if ((p = (GLchar *) calloc(n + 1, 1)))
+    {
+        glGetShaderSource(shader, n, NULL, p);
+        fprintf(stderr, "%s", p);
+        free(p);
+    }
+}
+
+int glsl_ready(glsl *G)
+{
+    GLint s = 1;
+
+    /* Determine whether the program may be awaited without blocking. */
+
+    if (G->pending && parallel_usable())
+        glGetProgramiv(G->program, GL_COMPLETION_STATUS_KHR, &s);
+
+    return s;
+}
+
+GLboolean glsl_await(glsl *G)
+{
+    GLint s = 0;
+
+    /* Nothing is pending after a failure or a cached load. */
+
+    if (G->pending == 0)
+        return (G->program || (G->vert_shader && G->frag_shader));
+
+    G->pending = 0;
+
+    /* Check the link status, which waits for completion. On failure, find */
+    /* and report the source of the problem.                                */
+
+    glGetProgramiv(G->program, GL_LINK_STATUS, &s);
+
+    if (s == 0)
+    {
+        if (check_shader_log(G->vert_shader) == 0)
         {
-            G->program = glsl_init_program(G->vert_shader, G->frag_shader);
-            return GL_TRUE;
+            print_source(G->vert_shader);
+            glDeleteShader(G->vert_shader);
+            G->vert_shader = 0;
         }
+        if (check_shader_log(G->frag_shader) == 0)
+        {
+            print_source(G->frag_shader);
+            glDeleteShader(G->frag_shader);
+            G->frag_shader = 0;
+        }
+        if (G->vert_shader && G->frag_shader)
+            check_program_log(G->program);
+
+        glDeleteProgram(G->program);
+        G->program = 0;
+
+        return (G->vert_shader && G->frag_shader);
     }
+
+    /* Cache the binary of the linked program, and list its variables. */
+
+    if (G->key)
+        cache_store(G->key, G->program);
+
+    table_init(G);
+
+    return GL_TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+
+GLboolean glsl_source_async(glsl *G, const char *vert_str, int vert_len,
+                                     const char *frag_str, int frag_len)
+{
+    /* Clear the structure so that it may be deleted even upon failure. */
+
+    G->vert_filename = NULL;
+    G->frag_filename = NULL;
+    G->vert_shader   = 0;
+    G->frag_shader   = 0;
+    G->program       = 0;
+    G->pending       = 0;
+    G->key           = 0;
+
+    table_clear(G);
+
+    if (vert_str && frag_str)
+        return glsl_submit(G, vert_str, vert_len, frag_str, frag_len);
+
     return GL_FALSE;
 }
 
-GLboolean glsl_create(glsl *G, const char *vert_filename,
-                               const char *frag_filename)
+GLboolean glsl_create_async(glsl *G, const char *vert_filename,
+                                     const char *frag_filename)
 {
     GLboolean ret = GL_FALSE;
 
@@ -213,9 +927,9 @@ GLboolean glsl_create(glsl *G, const char *vert_filename,
         char *vert_str = load_str(vert_filename);
         char *frag_str = load_str(frag_filename);
 
-        /* Compile the shaders. */
+        /* Begin compiling the shaders. */
 
-        ret = glsl_source(G, vert_str, -1, frag_str, -1);
+        ret = glsl_source_async(G, vert_str, -1, frag_str, -1);
 
         /* Cache the given file names to ease reloading. */
 
@@ -228,36 +942,47 @@ GLboolean glsl_create(glsl *G, const char *vert_filename,
     return ret;
 }
 
+GLboolean glsl_source(glsl *G, const char *vert_str, int vert_len,
+                               const char *frag_str, int frag_len)
+{
+    return glsl_source_async(G, vert_str, vert_len, frag_str, frag_len)
+        && glsl_await(G);
+}
+
+GLboolean glsl_create(glsl *G, const char *vert_filename,
+                               const char *frag_filename)
+{
+    return glsl_create_async(G, vert_filename, frag_filename)
+        && glsl_await(G);
+}
+
 GLboolean glsl_reload(glsl *G)
 {
     if (G->vert_filename && G->frag_filename)
     {
+        GLboolean ret;
+
         /* Reload the shader source. */
 
         char *vert_str = load_str(G->vert_filename);
         char *frag_str = load_str(G->frag_filename);
 
-        /* Delete the old program and shaders. */
+        /* Delete the old program, shaders, and variables. */
 
         glDeleteProgram(G->program);
         glDeleteShader(G->frag_shader);
         glDeleteShader(G->vert_shader);
 
-        /* Compile the new shaders. */
+        table_free(G);
+
+        /* Compile and link the new program. */
 
-        G->vert_shader = glsl_init_shader(GL_VERTEX_SHADER,   vert_str, -1);
-        G->frag_shader = glsl_init_shader(GL_FRAGMENT_SHADER, frag_str, -1);
+        ret = glsl_submit(G, vert_str, -1, frag_str, -1) && glsl_await(G);
 
         free(frag_str);
         free(vert_str);
 
-        /*  Compile the new program. */
-
-        if (G->vert_shader && G->frag_shader)
-        {
-            G->program = glsl_init_program(G->vert_shader, G->frag_shader);
-            return GL_TRUE;
-        }
+        return ret;
     }
     return GL_FALSE;
 }
@@ -270,7 +995,9 @@ void glsl_delete(glsl *G)
     glDeleteShader(G->frag_shader);
     glDeleteShader(G->vert_shader);
 
-    /* Release the filename cache. */
+    /* Release the variable table and filename cache. */
+
+    table_free(G);
 
     if (G->vert_filename) free(G->vert_filename);
     if (G->frag_filename) free(G->frag_filename);
@@ -282,16 +1009,32 @@ void glsl_delete(glsl *G)
 
 GLint glsl_uniform(GLuint program, const char *fmt, ...)
 {
-    GLint loc = 0;
+    GLint   loc = -1;
+    char    str[256];
+    char   *p;
+    int     n;
     va_list ap;
 
     va_start(ap, fmt);
+    n = vsnprintf(str, sizeof (str), fmt, ap);
+    va_end(ap);
+
+    /* Format the name again into a larger buffer if it didn't fit. */
+
+    if (n >= (int) sizeof (str))
     {
-        char str[256];
-        vsprintf(str, fmt, ap);
-        loc = glGetUniformLocation(program, str);
+        if ((p = (char *) malloc(n + 1)))
+        {
+            va_start(ap, fmt);
+            vsnprintf(p, n + 1, fmt, ap);
+            va_end(ap);
+
+            loc = glGetUniformLocation(program, p);
+            free(p);
+        }
     }
-    va_end(ap);
+    else if (n >= 0)
+        loc = glGetUniformLocation(program, str);
 
     return loc;
 }
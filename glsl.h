@@ -31,6 +31,8 @@ extern "C" {
 
 /*----------------------------------------------------------------------------*/
 
+struct glsl_var;
+
 struct glsl
 {
     char  *vert_filename;
@@ -40,6 +42,15 @@ struct glsl
     GLuint frag_shader;
 
     GLuint program;
+
+    int                pending;
+    unsigned long long key;
+
+    struct glsl_var   *vars;
+    int               *index;
+    GLint             *values;
+    int                var_count;
+    int                index_size;
 };
 
 typedef struct glsl glsl;
@@ -62,8 +73,24 @@ GLboolean glsl_create(glsl *, const char *,      const char *);
 GLboolean glsl_reload(glsl *);
 void      glsl_delete(glsl *);
 
+GLboolean glsl_source_async(glsl *, const char *, int, const char *, int);
+GLboolean glsl_create_async(glsl *, const char *,      const char *);
+int       glsl_ready       (glsl *);
+GLboolean glsl_await       (glsl *);
+
 GLint     glsl_uniform(GLuint, const char *, ...);
 
+GLint     glsl_uniform_location(glsl *, const char *);
+GLint     glsl_attrib_location (glsl *, const char *);
+
+void      glsl_uniformf  (glsl *, const char *, GLfloat);
+void      glsl_uniformi  (glsl *, const char *, GLint);
+void      glsl_uniformfv (glsl *, const char *, GLsizei, const GLfloat *);
+void      glsl_uniformiv (glsl *, const char *, GLsizei, const GLint *);
+void      glsl_uniformuiv(glsl *, const char *, GLsizei, const GLuint *);
+
+void      glsl_cache_dir(const char *);
+
 /*----------------------------------------------------------------------------*/
 
 #ifdef __cplusplus
@@ -27,12 +27,28 @@
 
 #include <GL/glew.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef CONFIG_NO_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+#include "image.h"
+
 /* NOTE: Channel byte count implies channel storage type:                     */
 /*     b = 1 selects unsigned byte                                            */
 /*     b = 2 selects unsigned short                                           */
 /*     b = 4 selects float                                                    */
-
-#define CONFIG_NO_EXR 1
+/*     b = IMAGE_HALF (-2) selects half float                                 */
 
 /*----------------------------------------------------------------------------*/
 
@@ -697,673 +713,4719 @@ static void fail(const char *name, const char *error)
 
 /*----------------------------------------------------------------------------*/
 
-/* Flip the given image buffer vertically.                                    */
+/* Return the storage size of a channel of type b.                            */
 
-void image_flip(int w, int h, int c, int b, void *p)
+static int bsize(int b)
 {
-    const int s = w * c * b;
-
-    void *t;
-    int   i;
-
-    if ((t = malloc(s)))
-    {
-        for (i = 0; i < h / 2; ++i)
-        {
-            unsigned char *a = (unsigned char *) p + (        i) * s;
-            unsigned char *b = (unsigned char *) p + (h - 1 - i) * s;
-
-            memcpy(t, a, s);
-            memcpy(a, b, s);
-            memcpy(b, t, s);
-        }
-        free(t);
-    }
-    else fail("image_flip", "Failure to allocate temporary buffer");
+    return (b < 0) ? -b : b;
 }
 
 /*----------------------------------------------------------------------------*/
 
-#ifndef CONFIG_NO_PNG
-#include <png.h>
-
-void *image_read_png(const char *name, int *w, int *h, int *c, int *b)
-{
-    png_structp rp = NULL;
-    png_infop   ip = NULL;
-    png_bytep  *bp = NULL;
-    FILE       *fp = NULL;
-    void        *p = NULL;
-
-    assert(name);
-    assert(w);
-    assert(h);
-    assert(c);
-    assert(b);
-
-    /* Initialize all PNG import data structures. */
-
-    if (!(fp = fopen(name, "rb")))
-        fail(name, strerror(errno));
-
-    if (!(rp = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0)))
-        fail(name, "Failure to allocate PNG read structure");
-
-    if (!(ip = png_create_info_struct(rp)))
-        fail(name, "Failure to allocate PNG info structure");
-
-    /* Enable the default PNG error handler. */
-
-    if (setjmp(png_jmpbuf(rp)) == 0)
-    {
-        /* Read the PNG header. */
+/* All memory allocated by this module, whether returned to the caller or     */
+/* used internally, passes through these hooks.                               */
 
-        png_init_io (rp, fp);
-        png_read_png(rp, ip, PNG_TRANSFORM_EXPAND  |
-                             PNG_TRANSFORM_PACKING |
-                             PNG_TRANSFORM_SWAP_ENDIAN, NULL);
+static image_malloc_f  hook_malloc  = malloc;
+static image_realloc_f hook_realloc = realloc;
+static image_free_f    hook_free    = free;
 
-        *w = (int) png_get_image_width (rp, ip);
-        *h = (int) png_get_image_height(rp, ip);
-        *c = (int) png_get_channels    (rp, ip);
-        *b = (int) png_get_bit_depth   (rp, ip) / 8;
+void image_allocator(image_malloc_f m, image_realloc_f r, image_free_f f)
+{
+    hook_malloc  = m ? m : malloc;
+    hook_realloc = r ? r : realloc;
+    hook_free    = f ? f : free;
+}
 
-        /* Read the pixel data. */
+void image_free(void *p)
+{
+    if (p) hook_free(p);
+}
 
-        if ((bp = png_get_rows(rp, ip)))
-        {
-            /* Allocate the final buffer and flip-copy the pixels there. */
+/*----------------------------------------------------------------------------*/
 
-            int i, j, s = (*w) * (*c) * (*b);
+/* Data-parallel operations divide their work into contiguous bands of rows,  */
+/* processing one band on the calling thread and the rest on new threads.     */
 
-            if ((p = malloc((*w) * (*h) * (*c) * (*b))))
+#ifndef CONFIG_NO_THREAD
+#include <pthread.h>
+#endif
 
-                for (i = 0, j = (*h) - 1; j >= 0; ++i, --j)
-                    memcpy((png_bytep) p + s * i, bp[i], s);
+#define MAX_THREADS 64
 
-            else fail(name, "Failure to allocate image buffer");
-        }
-    }
+typedef void (*band_f)(void *, int, int);
 
-    /* Release all resources. */
+struct band
+{
+    band_f f;
+    void  *d;
+    int    i;
+    int    j;
+};
 
-    png_destroy_read_struct(&rp, &ip, NULL);
-    fclose(fp);
+static int thread_count = 0;
 
-    return p;
+void image_threads(int n)
+{
+    thread_count = (n < MAX_THREADS) ? n : MAX_THREADS;
 }
 
-void image_write_png(const char *name, int w, int h, int c, int b, void *p)
+static int threads(void)
 {
-    png_structp wp = NULL;
-    png_infop   ip = NULL;
-    png_bytep  *bp = NULL;
-    FILE       *fp = NULL;
+    int n = thread_count;
 
-    assert(name);
-    assert(p);
+#ifndef CONFIG_NO_THREAD
+    if (n <= 0)
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1)           n = 1;
+    if (n > MAX_THREADS) n = MAX_THREADS;
 
-    /* Initialize all PNG export data structures. */
+    return n;
+}
 
-    if (!(fp = fopen(name, "wb")))
-        fail(name, strerror(errno));
+#ifndef CONFIG_NO_THREAD
+static void *band_run(void *p)
+{
+    struct band *B = (struct band *) p;
+    B->f(B->d, B->i, B->j);
+    return NULL;
+}
+#endif
 
-    if (!(wp = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0)))
-        fail(name, "Failure to allocate PNG write structure");
+/* Apply f to the range [0, n) in bands of at least m items.                  */
 
-    if (!(ip = png_create_info_struct(wp)))
-        fail(name, "Failure to allocate PNG info structure");
+static void parallel(band_f f, void *d, int n, int m)
+{
+    int k = threads();
 
-    /* Enable the default PNG error handler. */
+    if (m < 1)
+        m = 1;
+    if (k > (n + m - 1) / m)
+        k = (n + m - 1) / m;
 
-    if (setjmp(png_jmpbuf(wp)) == 0)
+#ifndef CONFIG_NO_THREAD
+    if (k > 1)
     {
-        static const int color[] = {
-            0,
-            PNG_COLOR_TYPE_GRAY,
-            PNG_COLOR_TYPE_GRAY_ALPHA,
-            PNG_COLOR_TYPE_RGB,
-            PNG_COLOR_TYPE_RGB_ALPHA
-        };
-
-        /* Initialize the PNG header. */
+        struct band B[MAX_THREADS];
+        pthread_t   T[MAX_THREADS];
+        int         r[MAX_THREADS];
+        int         t;
 
-        png_init_io (wp, fp);
-/*      png_set_compression_level(wp, 9); */
-        png_set_IHDR(wp, ip, w, h, b*8, color[c], PNG_INTERLACE_NONE,
-                                                  PNG_COMPRESSION_TYPE_DEFAULT,
-                                                  PNG_FILTER_TYPE_DEFAULT);
-
-        /* Allocate and initialize the row pointers. */
-
-        if ((bp = (png_bytep *) png_malloc(wp, h * sizeof (png_bytep))))
+        for (t = 0; t < k; ++t)
         {
-            int i, j;
+            B[t].f = f;
+            B[t].d = d;
+            B[t].i = (int) ((long long) n * (t    ) / k);
+            B[t].j = (int) ((long long) n * (t + 1) / k);
+        }
 
-            for (i = 0, j = h - 1; j >= 0; ++i, --j)
-                bp[i] = (png_bytep) p + i * w * c * b;
+        /* Fall back to the calling thread if a thread can't be created. */
 
-            /* Write the PNG image file. */
+        for (t = 1; t < k; ++t)
+            r[t] = pthread_create(T + t, NULL, band_run, B + t);
 
-            png_set_rows  (wp, ip, bp);
-            png_write_info(wp, ip);
-            png_write_png (wp, ip, PNG_TRANSFORM_SWAP_ENDIAN, NULL);
+        f(d, B[0].i, B[0].j);
 
-            free(bp);
-        }
-        else fail(name, "Failure to allocate PNG row array");
+        for (t = 1; t < k; ++t)
+            if (r[t] == 0)
+                pthread_join(T[t], NULL);
+            else
+                f(d, B[t].i, B[t].j);
+        return;
     }
-
-    /* Release all resources. */
-
-    png_destroy_write_struct(&wp, &ip);
-    fclose(fp);
+#endif
+    if (n > 0)
+        f(d, 0, n);
 }
 
-#endif /* CONFIG_NO_PNG */
-
 /*----------------------------------------------------------------------------*/
 
-#ifndef CONFIG_NO_JPG
-#include <jpeglib.h>
+/* Exchange n bytes between a and b.                                          */
 
-void *image_read_jpg(const char *name, int *w, int *h, int *c, int *b)
+static void swap(unsigned char *a, unsigned char *b, size_t n)
 {
-    unsigned char *p = NULL;
-
-    FILE *fp;
-
-    assert(name);
-    assert(w);
-    assert(h);
-    assert(c);
-    assert(b);
-
-    if ((fp = fopen(name, "rb")))
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= n; i += 64)
     {
-        struct jpeg_decompress_struct cinfo;
-        struct jpeg_error_mgr         jerr;
+        __m128i x0 = _mm_loadu_si128((const __m128i *) (a + i +  0));
+        __m128i x1 = _mm_loadu_si128((const __m128i *) (a + i + 16));
+        __m128i x2 = _mm_loadu_si128((const __m128i *) (a + i + 32));
+        __m128i x3 = _mm_loadu_si128((const __m128i *) (a + i + 48));
+        __m128i y0 = _mm_loadu_si128((const __m128i *) (b + i +  0));
+        __m128i y1 = _mm_loadu_si128((const __m128i *) (b + i + 16));
+        __m128i y2 = _mm_loadu_si128((const __m128i *) (b + i + 32));
+        __m128i y3 = _mm_loadu_si128((const __m128i *) (b + i + 48));
+
+        _mm_storeu_si128((__m128i *) (a + i +  0), y0);
+        _mm_storeu_si128((__m128i *) (a + i + 16), y1);
+        _mm_storeu_si128((__m128i *) (a + i + 32), y2);
+        _mm_storeu_si128((__m128i *) (a + i + 48), y3);
+        _mm_storeu_si128((__m128i *) (b + i +  0), x0);
+        _mm_storeu_si128((__m128i *) (b + i + 16), x1);
+        _mm_storeu_si128((__m128i *) (b + i + 32), x2);
+        _mm_storeu_si128((__m128i *) (b + i + 48), x3);
+    }
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *) (b + i));
 
-        unsigned char *s[1];
+        _mm_storeu_si128((__m128i *) (a + i), y);
+        _mm_storeu_si128((__m128i *) (b + i), x);
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        unsigned char t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+}
 
-        /* Initialize the JPG decompressor. */
+/* Flip the given image buffer vertically, in place.                          */
 
-        cinfo.err = jpeg_std_error(&jerr);
+void image_flip(int w, int h, int c, int b, void *p)
+{
+    const size_t s = (size_t) w * c * bsize(b);
 
-        jpeg_create_decompress(&cinfo);
-        jpeg_stdio_src(&cinfo, fp);
+    int i;
 
-        /* Grab the JPG header info. */
+    for (i = 0; i < h / 2; ++i)
+        swap((unsigned char *) p + s * (        i),
+             (unsigned char *) p + s * (h - 1 - i), s);
+}
 
-        jpeg_read_header(&cinfo, TRUE);
-        jpeg_start_decompress(&cinfo);
+/* Copy a W-by-H image of z-byte pixels to q, where pixel (x, y) of q is read */
+/* from p + x * dx + y * dy. Work in tiles so that both the reads and the     */
+/* writes stay within a small set of cache lines.                             */
 
-        *w = cinfo.output_width;
-        *h = cinfo.output_height;
-        *c = cinfo.output_components;
-        *b = 1;
+#define TILE 32
 
-        /* Allocate the pixel buffer and copy pixels there. */
+static void transform(unsigned char *q, int W, int H, int z,
+                const unsigned char *p, ptrdiff_t dx, ptrdiff_t dy)
+{
+    int x0, x1, x;
+    int y0, y1, y;
 
-        if ((p = (unsigned char *) malloc ((*w) * (*h) * (*c))))
+    for     (y0 = 0; y0 < H; y0 += TILE)
+        for (x0 = 0; x0 < W; x0 += TILE)
         {
-            while (cinfo.output_scanline < cinfo.output_height)
+            x1 = (x0 + TILE < W) ? x0 + TILE : W;
+            y1 = (y0 + TILE < H) ? y0 + TILE : H;
+
+            for (y = y0; y < y1; ++y)
             {
-                s[0] = p + cinfo.output_scanline * (*w) * (*c);
-                jpeg_read_scanlines(&cinfo, s, 1);
+                unsigned char       *o = q + ((size_t) y * W + x0) * z;
+                const unsigned char *i = p + y * dy + x0 * dx;
+
+                switch (z)
+                {
+                case  1: for (x = x0; x < x1; ++x, o +=  1, i += dx) memcpy(o, i,  1); break;
+                case  2: for (x = x0; x < x1; ++x, o +=  2, i += dx) memcpy(o, i,  2); break;
+                case  3: for (x = x0; x < x1; ++x, o +=  3, i += dx) memcpy(o, i,  3); break;
+                case  4: for (x = x0; x < x1; ++x, o +=  4, i += dx) memcpy(o, i,  4); break;
+                case  8: for (x = x0; x < x1; ++x, o +=  8, i += dx) memcpy(o, i,  8); break;
+                case 16: for (x = x0; x < x1; ++x, o += 16, i += dx) memcpy(o, i, 16); break;
+                default: for (x = x0; x < x1; ++x, o +=  z, i += dx) memcpy(o, i,  z); break;
+                }
             }
         }
-        else fail(name, "Failure to allocate image buffer");
+}
 
-        /* Finalize the decompression. */
+/* Transpose the w-by-h image at p to the h-by-w image at q.                  */
 
-        jpeg_finish_decompress (&cinfo);
-        jpeg_destroy_decompress(&cinfo);
+void image_transpose(int w, int h, int c, int b, const void *p, void *q)
+{
+    const ptrdiff_t z = (ptrdiff_t) c * bsize(b);
+    const ptrdiff_t s = (ptrdiff_t) w * z;
 
-        fclose(fp);
-    }
-    else fail(name, strerror(errno));
+    assert(p != q);
 
-    return p;
+    transform((unsigned char *) q, h, w, (int) z,
+        (const unsigned char *) p, s, z);
 }
 
-void image_write_jpg(const char *name, int w, int h, int c, int b, void *p)
+/* Rotate the w-by-h image at p by n quarter turns counterclockwise to q.     */
+/* Odd n gives an h-by-w result.                                              */
+
+void image_rotate(int w, int h, int c, int b, const void *p, void *q, int n)
 {
-    FILE *fp;
+    const ptrdiff_t z = (ptrdiff_t) c * bsize(b);
+    const ptrdiff_t s = (ptrdiff_t) w * z;
 
-    assert(name);
-    assert(p);
+    const unsigned char *P = (const unsigned char *) p;
+    unsigned char       *Q = (unsigned char       *) q;
 
-    if ((fp = fopen(name, "wb")))
+    assert(p != q);
+
+    switch (n & 3)
     {
-        struct jpeg_compress_struct cinfo;
-        struct jpeg_error_mgr       jerr;
+    case 0: transform(Q, w, h, (int) z, P,                               z,  s); break;
+    case 1: transform(Q, h, w, (int) z, P + (w - 1) * z,                 s, -z); break;
+    case 2: transform(Q, w, h, (int) z, P + (h - 1) * s + (w - 1) * z,  -z, -s); break;
+    case 3: transform(Q, h, w, (int) z, P + (h - 1) * s,                -s,  z); break;
+    }
+}
 
-        unsigned char *s[1];
+/* Ensure that a destination buffer exists for a w-by-h image of c channels   */
+/* of b bytes each. If p is null, allocate a tightly-packed buffer. If the    */
+/* row stride s is zero, assume tight packing.                                */
 
-        /* Initialize the JPG compressor. */
+static void *dest(const char *name, void *p, int *s, int w, int h, int c, int b)
+{
+    if (*s == 0)
+        *s = w * c * bsize(b);
 
-        cinfo.err = jpeg_std_error(&jerr);
+    if (p == NULL)
+    {
+        *s = w * c * bsize(b);
 
-        jpeg_create_compress(&cinfo);
-        jpeg_stdio_dest(&cinfo, fp);
+        if ((p = hook_malloc((size_t) w * h * c * bsize(b))) == NULL)
+            fail(name, "Failure to allocate image buffer");
+    }
+    return p;
+}
 
-        /* Set the JPG header info. */
+/* Return a pointer to the ith row of an h-row image at p with row stride s.  */
+/* Rows are counted from the top, or from the bottom if o is bottom-left.     */
 
-        cinfo.image_width      = w;
-        cinfo.image_height     = h;
-        cinfo.input_components = c;
+static void *row(const void *p, size_t s, int h, int i, int o)
+{
+    return (char *) p + s * (size_t) ((o == IMAGE_BOTTOM_LEFT) ? h - 1 - i : i);
+}
 
-        if (c == 1) cinfo.in_color_space = JCS_GRAYSCALE;
-        if (c == 3) cinfo.in_color_space = JCS_RGB;
+/* Store and load big-endian 32-bit integers, as used by PNG and QOI.         */
 
-        jpeg_set_defaults  (&cinfo);
-        jpeg_set_quality   (&cinfo, 75, TRUE);
-        jpeg_start_compress(&cinfo,     TRUE);
+static void put32be(unsigned char *p, unsigned long u)
+{
+    p[0] = (unsigned char) (u >> 24);
+    p[1] = (unsigned char) (u >> 16);
+    p[2] = (unsigned char) (u >>  8);
+    p[3] = (unsigned char) (u);
+}
 
-        /* Write each scanline in turn. */
+static unsigned long get32be(const unsigned char *p)
+{
+    return (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16
+         | (unsigned long) p[2] <<  8 | (unsigned long) p[3];
+}
 
-        while (cinfo.next_scanline < cinfo.image_height)
-        {
-            s[0] = (unsigned char *) p + w * c * cinfo.next_scanline;
-            jpeg_write_scanlines(&cinfo, s, 1);
-        }
+/* An encoded image held in memory, with a read position.                     */
 
-        /* Finalize the compression. */
+struct membuf
+{
+    const unsigned char *p;
+    size_t               n;
+    size_t               i;
+};
 
-        jpeg_finish_compress (&cinfo);
-        jpeg_destroy_compress(&cinfo);
+/*----------------------------------------------------------------------------*/
 
-        fclose(fp);
-    }
-    else fail(name, strerror(errno));
+#ifndef CONFIG_NO_PNG
+#include <png.h>
+#include <zlib.h>
+
+static png_voidp png_hook_malloc(png_structp pp, png_alloc_size_t n)
+{
+    return hook_malloc((size_t) n);
 }
 
-#endif /* CONFIG_NO_JPG */
+static void png_hook_free(png_structp pp, png_voidp p)
+{
+    hook_free(p);
+}
 
-/*----------------------------------------------------------------------------*/
+static void png_mem_read(png_structp rp, png_bytep d, png_size_t n)
+{
+    struct membuf *m = (struct membuf *) png_get_io_ptr(rp);
 
-#ifndef CONFIG_NO_EXR
-#include <OpenEXR/ImfCRgbaFile.h>
+    if (m->i + n > m->n)
+        png_error(rp, "Read past end of buffer");
 
-void *image_read_exr(const char *name, int *w, int *h, int *c, int *b)
+    memcpy(d, m->p + m->i, n);
+    m->i += n;
+}
+
+/* Configure the PNG transforms and update the header to reflect them.        */
+
+static void png_header(png_structp rp, png_infop ip,
+                       int *w, int *h, int *c, int *b)
 {
-    ImfInputFile    *file;
-    ImfRgba         *data;
-    const ImfHeader *head;
+    png_read_info(rp, ip);
 
-    float *p = 0;
+    png_set_expand(rp);
+    png_set_packing(rp);
 
-    if ((file = ImfOpenInputFile(name)))
-    {
-         if ((head = ImfInputHeader(file)))
-         {
-             int x0;
-             int x1;
-             int y0;
-             int y1;
-             int i;
+    if (png_get_bit_depth(rp, ip) == 16)
+        png_set_swap(rp);
 
-             /* Read and extract header info. */
+    png_set_interlace_handling(rp);
+    png_read_update_info(rp, ip);
 
-             ImfHeaderDataWindow(head, &x0, &y0, &x1, &y1);
+    *w = (int) png_get_image_width (rp, ip);
+    *h = (int) png_get_image_height(rp, ip);
+    *c = (int) png_get_channels    (rp, ip);
+    *b = (int) png_get_bit_depth   (rp, ip) / 8;
+}
 
-             *w = x1 - x0 + 1;
-             *h = y1 - y0 + 1;
-             *c = 4;
-             *b = sizeof (float);
+static void *read_png(const char *name, struct membuf *m, void *p, int s, int o,
+                      int *w, int *h, int *c, int *b)
+{
+    png_structp rp = NULL;
+    png_infop   ip = NULL;
+    FILE       *fp = NULL;
 
-             /* Allocate temporary storage and read pixel data to it. */
+    void *volatile q = p;
+    png_bytep *volatile bp = NULL;
 
-             if ((data = (ImfRgba *) malloc((*w) * (*h) * sizeof (ImfRgba))))
-             {
-                 ImfInputSetFrameBuffer(file, data - x0 - y0 * (*w), 1, (*w));
-                 ImfInputReadPixels    (file, y0, y1);
+    assert(name);
+    assert(w);
+    assert(h);
+    assert(c);
+    assert(b);
 
-                 /* Allocate final storage and copy pixel data to it. */
+    /* Initialize all PNG import data structures. */
 
-                 if ((p = (float *) malloc((*w) * (*h) * (*c) * (*b))))
-                 {
-                     for (i = 0; i < (*w) * (*h); ++i)
-                     {
-                         p[i * 4 + 0] = ImfHalfToFloat(data[i].r);
-                         p[i * 4 + 1] = ImfHalfToFloat(data[i].g);
-                         p[i * 4 + 2] = ImfHalfToFloat(data[i].b);
-                         p[i * 4 + 3] = ImfHalfToFloat(data[i].a);
-                     }
-                 }
-                 free(data);
-             }
-         }
-         ImfCloseInputFile(file);
-    }
-    return p;
-}
+    if (m == NULL && !(fp = fopen(name, "rb")))
+        fail(name, strerror(errno));
 
-void image_write_exr(const char *name, int w, int h, int c, int b, void *p)
-{
-    ImfOutputFile *file;
-    ImfRgba       *data;
-    ImfHeader     *head;
+    if (!(rp = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0,
+                                        0, png_hook_malloc, png_hook_free)))
+        fail(name, "Failure to allocate PNG read structure");
 
-    const float *q = (const float *) p;
+    if (!(ip = png_create_info_struct(rp)))
+        fail(name, "Failure to allocate PNG info structure");
 
-    /* Allocation and intialize a new header. */
+    /* Enable the default PNG error handler. */
 
-    if ((head = ImfNewHeader()))
+    if (setjmp(png_jmpbuf(rp)) == 0)
     {
-        ImfHeaderSetDataWindow   (head, 0, 0, w - 1, h - 1);
-        ImfHeaderSetDisplayWindow(head, 0, 0, w - 1, h - 1);
-        ImfHeaderSetCompression  (head, IMF_ZIP_COMPRESSION);
-        ImfHeaderSetLineOrder    (head, IMF_INCREASING_Y);
+        int i;
 
-        if ((file = ImfOpenOutputFile(name, head, IMF_WRITE_RGBA)))
-        {
-             /* Allocate temporary storage and copy pixel data to it. */
+        /* Read the PNG header from the file or buffer. */
 
-             if ((data = (ImfRgba *) calloc(w * h, sizeof (ImfRgba))))
-             {
-                 int i;
+        if (fp)
+            png_init_io(rp, fp);
+        else
+            png_set_read_fn(rp, m, png_mem_read);
 
-                 for (i = 0; i < w * h; ++i)
-                 {
-                     float R = (c > 0) ? q[i * c + 0] : 0.0f;
-                     float G = (c > 1) ? q[i * c + 1] : 0.0f;
-                     float B = (c > 2) ? q[i * c + 2] : 0.0f;
-                     float A = (c > 3) ? q[i * c + 3] : 1.0f;
+        png_header(rp, ip, w, h, c, b);
 
-                     ImfFloatToHalf(R, &data[i].r);
-                     ImfFloatToHalf(G, &data[i].g);
-                     ImfFloatToHalf(B, &data[i].b);
-                     ImfFloatToHalf(A, &data[i].a);
-                 }
+        /* Point the row array at the destination buffer and decode there. */
 
-                 /* Write the file. */
+        q = dest(name, p, &s, *w, *h, *c, *b);
 
-                 ImfOutputSetFrameBuffer(file, data, 1, w);
-                 ImfOutputWritePixels   (file, h);
+        if ((bp = (png_bytep *) hook_malloc((*h) * sizeof (png_bytep))))
+        {
+            for (i = 0; i < (*h); ++i)
+                bp[i] = (png_bytep) row(q, s, *h, i, o);
 
-                 free(data);
-             }
-             ImfCloseOutputFile(file);
-         }
-         ImfDeleteHeader(head);
+            png_read_image(rp, bp);
+            png_read_end  (rp, NULL);
+        }
+        else fail(name, "Failure to allocate PNG row array");
     }
-}
+    else
+    {
+        /* Release the buffer on error, but only if we allocated it. */
 
-#endif /* CONFIG_NO_EXR */
+        if (q != p)
+            image_free(q);
+        q = NULL;
+    }
 
-/*----------------------------------------------------------------------------*/
+    /* Release all resources. */
 
-#ifndef CONFIG_NO_TIF
-#include <tiffio.h>
+    image_free(bp);
+    png_destroy_read_struct(&rp, &ip, NULL);
 
-void *image_read_tif(const char *name, int *w, int *h, int *c, int *b, int n)
-{
-    TIFF *T = 0;
-    void *p = 0;
+    if (fp)
+        fclose(fp);
 
-    TIFFSetWarningHandler(0);
+    return q;
+}
 
-    if ((T = TIFFOpen(name, "r")))
+static int info_png(const char *name, int *w, int *h, int *c, int *b)
+{
+    png_structp rp = NULL;
+    png_infop   ip = NULL;
+    FILE       *fp = NULL;
+    int         ok = 0;
+
+    if ((fp = fopen(name, "rb")))
     {
-        if ((n == 0) || TIFFSetDirectory(T, n))
+        if ((rp = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0,
+                                           0, png_hook_malloc, png_hook_free)))
         {
-            uint32 i, s = (uint32) TIFFScanlineSize(T);
-            uint32 W, H;
-            uint16 B, C;
-
-            TIFFGetField(T, TIFFTAG_IMAGEWIDTH,      &W);
+            if ((ip = png_create_info_struct(rp)))
+            {
+                if (setjmp(png_jmpbuf(rp)) == 0)
+                {
+                    png_init_io(rp, fp);
+                    png_header (rp, ip, w, h, c, b);
+                    ok = 1;
+                }
+            }
+            png_destroy_read_struct(&rp, &ip, NULL);
+        }
+        fclose(fp);
+    }
+    return ok;
+}
+
+void *image_read_png(const char *name, int *w, int *h, int *c, int *b)
+{
+    return read_png(name, NULL, NULL, 0, IMAGE_TOP_LEFT, w, h, c, b);
+}
+
+/* PNG files are written directly using zlib so that encoding may proceed in  */
+/* parallel. Rows are divided into bands, each filtered and deflated as an    */
+/* independent raw stream primed with the preceding 32K of filtered data.     */
+/* Every band but the last ends with a sync flush, which aligns it to a byte  */
+/* boundary, so that the bands concatenate into a single zlib stream. Each    */
+/* band is written as one IDAT chunk, and the checksums are combined.         */
+
+#define PNG_BAND (1 << 19)
+
+static voidpf z_hook_alloc(voidpf o, uInt n, uInt m)
+{
+    return hook_malloc((size_t) n * m);
+}
+
+static void z_hook_free(voidpf o, voidpf p)
+{
+    hook_free(p);
+}
+
+struct png_band
+{
+    unsigned char *q;
+    size_t         n;
+    size_t         m;
+    uLong          crc;
+    uLong          adler;
+};
+
+struct png_enc
+{
+    int w, h, c, b, o;
+    int rows;
+    int bands;
+
+    const void      *p;
+    size_t           s;
+    size_t           line;
+    struct png_band *B;
+};
+
+static int paeth(int a, int b, int c)
+{
+    const int p  = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+
+    return (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c);
+}
+
+static int png_predict(int t, int a, int b, int c)
+{
+    switch (t)
+    {
+    case 1: return a;
+    case 2: return b;
+    case 3: return (a + b) >> 1;
+    case 4: return paeth(a, b, c);
+    }
+    return 0;
+}
+
+/* Copy row y of the image to r in PNG byte order, or zero it if y precedes   */
+/* the first row.                                                             */
+
+static void png_raw(const struct png_enc *E, unsigned char *r, int y)
+{
+    const size_t n = E->line - 1;
+    size_t       i;
+
+    if (y < 0)
+        memset(r, 0, n);
+
+    else if (E->b == 2)
+    {
+        const unsigned short *u = (const unsigned short *)
+                                  row(E->p, E->s, E->h, y, E->o);
+
+        for (i = 0; i < n / 2; ++i)
+        {
+            r[2 * i + 0] = (unsigned char) (u[i] >> 8);
+            r[2 * i + 1] = (unsigned char) (u[i]);
+        }
+    }
+    else memcpy(r, row(E->p, E->s, E->h, y, E->o), n);
+}
+
+/* Filter row x, with preceding row y and d bytes per pixel, to f. Select the */
+/* filter type minimizing the sum of absolute differences, as libpng does.    */
+
+static void png_filter(unsigned char *f, const unsigned char *x,
+                       const unsigned char *y, size_t n, size_t d)
+{
+    unsigned long s[5] = { 0, 0, 0, 0, 0 };
+    size_t        i;
+    int           t;
+    int           k = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        const int a = (i >= d) ? x[i - d] : 0;
+        const int b = y[i];
+        const int c = (i >= d) ? y[i - d] : 0;
+
+        s[0] += abs((signed char) (x[i]));
+        s[1] += abs((signed char) (x[i] - a));
+        s[2] += abs((signed char) (x[i] - b));
+        s[3] += abs((signed char) (x[i] - ((a + b) >> 1)));
+        s[4] += abs((signed char) (x[i] - paeth(a, b, c)));
+    }
+    for (t = 1; t < 5; ++t)
+        if (s[t] < s[k])
+            k = t;
+
+    f[0] = (unsigned char) k;
+
+    for (i = 0; i < n; ++i)
+    {
+        const int a = (i >= d) ? x[i - d] : 0;
+        const int b = y[i];
+        const int c = (i >= d) ? y[i - d] : 0;
+
+        f[i + 1] = (unsigned char) (x[i] - png_predict(k, a, b, c));
+    }
+}
+
+/* Filter and deflate band k. Rows preceding the band are filtered as well,   */
+/* to give the dictionary, so that bands are fully independent.              */
+
+static void png_band(struct png_enc *E, int k)
+{
+    struct png_band *B = E->B + k;
+
+    const size_t n  = E->line - 1;
+    const size_t d  = (size_t) E->c * E->b;
+    const int    y0 = k * E->rows;
+    const int    y1 = (y0 + E->rows < E->h) ? y0 + E->rows : E->h;
+    const int    yp = (int) ((32768 + E->line - 1) / E->line);
+    const int    ys = (y0 - yp > 0) ? y0 - yp : 0;
+
+    unsigned char *F;
+    unsigned char *x;
+    unsigned char *t;
+    unsigned char *u;
+    z_stream       z;
+    size_t         l;
+    int            e;
+    int            y;
+
+    if ((F = (unsigned char *) hook_malloc((size_t) (y1 - ys) * E->line)) == NULL ||
+        (x = (unsigned char *) hook_malloc(n)) == NULL ||
+        (u = (unsigned char *) hook_malloc(n)) == NULL)
+        fail("image_write_png", "Failure to allocate PNG band buffers");
+
+    /* Filter all rows of the band and its dictionary. */
+
+    png_raw(E, u, ys - 1);
+
+    for (y = ys; y < y1; ++y)
+    {
+        png_raw(E, x, y);
+        png_filter(F + (size_t) (y - ys) * E->line, x, u, n, d);
+
+        t = x;
+        x = u;
+        u = t;
+    }
+
+    /* Deflate the band, growing the output buffer as needed. */
+
+    memset(&z, 0, sizeof (z_stream));
+
+    z.zalloc = z_hook_alloc;
+    z.zfree  = z_hook_free;
+
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                                                Z_FILTERED) != Z_OK)
+        fail("image_write_png", "Failure to initialize deflate");
+
+    if (y0 > ys)
+    {
+        l = (size_t) (y0 - ys) * E->line;
+        l = (l < 32768) ? l : 32768;
+
+        deflateSetDictionary(&z, F + (size_t) (y0 - ys) * E->line - l, (uInt) l);
+    }
+
+    l = (size_t) (y1 - y0) * E->line;
+
+    B->adler = adler32(adler32(0, NULL, 0), F + (size_t) (y0 - ys) * E->line, (uInt) l);
+    B->m     = l;
+    B->n     = 0;
+    B->q     = NULL;
+
+    z.next_in  = F + (size_t) (y0 - ys) * E->line;
+    z.avail_in = (uInt) l;
+
+    for (l = deflateBound(&z, l) + 64;; l *= 2)
+    {
+        if ((t = (unsigned char *) hook_realloc(B->q, l)) == NULL)
+            fail("image_write_png", "Failure to allocate PNG band buffers");
+
+        B->q        = t;
+        z.next_out  = B->q + B->n;
+        z.avail_out = (uInt) (l - B->n);
+
+        e = deflate(&z, (k == E->bands - 1) ? Z_FINISH : Z_SYNC_FLUSH);
+
+        B->n = l - z.avail_out;
+
+        if (e == Z_STREAM_END || (e == Z_OK && z.avail_out > 0))
+            break;
+        if (e != Z_OK && e != Z_BUF_ERROR)
+            fail("image_write_png", "Failure to deflate PNG data");
+    }
+    B->crc = crc32(crc32(0, NULL, 0), B->q, (uInt) B->n);
+
+    deflateEnd(&z);
+
+    image_free(u);
+    image_free(x);
+    image_free(F);
+}
+
+static void png_bands(void *d, int i, int j)
+{
+    int k;
+
+    for (k = i; k < j; ++k)
+        png_band((struct png_enc *) d, k);
+}
+
+/* Write a chunk of type t with data a and b of lengths n and m, the CRC of b */
+/* being given as k. Return zero if any write fails.                          */
+
+static int png_chunk(FILE *fp, const char *t, const unsigned char *a, size_t n,
+                                               const unsigned char *b, size_t m,
+                                               uLong k)
+{
+    unsigned char h[8];
+    unsigned long c;
+
+    put32be(h, (unsigned long) (n + m));
+    memcpy(h + 4, t, 4);
+
+    c = crc32(crc32(0, NULL, 0), h + 4, 4);
+
+    if (n) c = crc32(c, a, (uInt) n);
+    if (m) c = crc32_combine(c, k, (z_off_t) m);
+
+    if (fwrite(h, 1, 8, fp) != 8)      return 0;
+    if (n && fwrite(a, 1, n, fp) != n) return 0;
+    if (m && fwrite(b, 1, m, fp) != m) return 0;
+
+    put32be(h, c);
+    return (fwrite(h, 1, 4, fp) == 4);
+}
+
+static void write_png(const char *name, int w, int h, int c, int b,
+                      const void *p, int s, int o)
+{
+    static const unsigned char sig[8] = {
+        0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+    };
+    static const unsigned char color[5] = { 0, 0, 4, 2, 6 };
+
+    struct png_enc E;
+
+    unsigned char head[13];
+    unsigned char tail[6];
+    uLong         a = adler32(0, NULL, 0);
+    FILE         *fp;
+    int           ok;
+    int           k;
+
+    assert(name);
+    assert(p);
+    assert((1 <= c) && (c <= 4));
+
+    if (b != 1 && b != 2)
+        fail(name, "Unsupported PNG channel type");
+
+    /* Divide the image into bands. */
+
+    E.w     = w;
+    E.h     = h;
+    E.c     = c;
+    E.b     = b;
+    E.o     = o;
+    E.p     = p;
+    E.s     = s ? (size_t) s : (size_t) w * c * b;
+    E.line  = (size_t) w * c * b + 1;
+    E.rows  = (E.line < PNG_BAND) ? (int) (PNG_BAND / E.line) : 1;
+    E.bands = (h + E.rows - 1) / E.rows;
+
+    if ((E.B = (struct png_band *) hook_malloc(E.bands * sizeof (struct png_band))) == NULL)
+        fail(name, "Failure to allocate PNG band array");
+
+    parallel(png_bands, &E, E.bands, 1);
+
+    /* Write the header, the bands, the zlib trailer, and the end. */
+
+    if (!(fp = fopen(name, "wb")))
+        fail(name, strerror(errno));
+
+    put32be(head + 0, (unsigned long) w);
+    put32be(head + 4, (unsigned long) h);
+
+    head[ 8] = (unsigned char) (b * 8);
+    head[ 9] = color[c];
+    head[10] = 0;
+    head[11] = 0;
+    head[12] = 0;
+
+    ok = (fwrite(sig, 1, 8, fp) == 8);
+    ok = ok && png_chunk(fp, "IHDR", head, 13, NULL, 0, 0);
+
+    tail[0] = 0x78;
+    tail[1] = 0x9C;
+
+    for (k = 0; k < E.bands; ++k)
+    {
+        struct png_band *B = E.B + k;
+
+        a = adler32_combine(a, B->adler, (z_off_t) B->m);
+
+        ok = ok && png_chunk(fp, "IDAT", tail, k ? 0 : 2, B->q, B->n, B->crc);
+        image_free(B->q);
+    }
+    put32be(tail + 2, a);
+    ok = ok && png_chunk(fp, "IDAT", tail + 2, 4, NULL, 0, 0);
+    ok = ok && png_chunk(fp, "IEND", NULL, 0, NULL, 0, 0);
+
+    image_free(E.B);
+
+    if ((fclose(fp) != 0) | !ok)
+        fail(name, strerror(errno));
+}
+
+void image_write_png(const char *name, int w, int h, int c, int b, void *p)
+{
+    write_png(name, w, h, c, b, p, 0, IMAGE_TOP_LEFT);
+}
+
+#endif /* CONFIG_NO_PNG */
+
+/*----------------------------------------------------------------------------*/
+
+#ifndef CONFIG_NO_JPG
+#include <jpeglib.h>
+
+static void *read_jpg(const char *name, struct membuf *m, void *p, int s, int o,
+                      int *w, int *h, int *c, int *b)
+{
+    FILE *fp = NULL;
+
+    assert(name);
+    assert(w);
+    assert(h);
+    assert(c);
+    assert(b);
+
+    if (m || (fp = fopen(name, "rb")))
+    {
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_mgr         jerr;
+
+        unsigned char *r[1];
+
+        /* Initialize the JPG decompressor on the file or buffer. */
+
+        cinfo.err = jpeg_std_error(&jerr);
+
+        jpeg_create_decompress(&cinfo);
+
+        if (fp)
+            jpeg_stdio_src(&cinfo, fp);
+        else
+            jpeg_mem_src(&cinfo, (unsigned char *) m->p, (unsigned long) m->n);
+
+        /* Grab the JPG header info. */
+
+        jpeg_read_header(&cinfo, TRUE);
+        jpeg_start_decompress(&cinfo);
+
+        *w = cinfo.output_width;
+        *h = cinfo.output_height;
+        *c = cinfo.output_components;
+        *b = 1;
+
+        /* Decode each scanline directly to the destination buffer. */
+
+        p = dest(name, p, &s, *w, *h, *c, *b);
+
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            r[0] = (unsigned char *) row(p, s, *h, cinfo.output_scanline, o);
+            jpeg_read_scanlines(&cinfo, r, 1);
+        }
+
+        /* Finalize the decompression. */
+
+        jpeg_finish_decompress (&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+
+        if (fp)
+            fclose(fp);
+    }
+    else fail(name, strerror(errno));
+
+    return p;
+}
+
+static int info_jpg(const char *name, int *w, int *h, int *c, int *b)
+{
+    FILE *fp;
+
+    if ((fp = fopen(name, "rb")))
+    {
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_mgr         jerr;
+
+        cinfo.err = jpeg_std_error(&jerr);
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_stdio_src(&cinfo, fp);
+
+        jpeg_read_header(&cinfo, TRUE);
+        jpeg_calc_output_dimensions(&cinfo);
+
+        *w = cinfo.output_width;
+        *h = cinfo.output_height;
+        *c = cinfo.output_components;
+        *b = 1;
+
+        jpeg_destroy_decompress(&cinfo);
+
+        fclose(fp);
+        return 1;
+    }
+    return 0;
+}
+
+void *image_read_jpg(const char *name, int *w, int *h, int *c, int *b)
+{
+    return read_jpg(name, NULL, NULL, 0, IMAGE_TOP_LEFT, w, h, c, b);
+}
+
+static void write_jpg(const char *name, int w, int h, int c, int b,
+                      const void *p, int s, int o)
+{
+    FILE *fp;
+
+    assert(name);
+    assert(p);
+
+    if ((fp = fopen(name, "wb")))
+    {
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr       jerr;
+
+        unsigned char *r[1];
+
+        /* Initialize the JPG compressor. */
+
+        cinfo.err = jpeg_std_error(&jerr);
+
+        jpeg_create_compress(&cinfo);
+        jpeg_stdio_dest(&cinfo, fp);
+
+        /* Set the JPG header info. */
+
+        cinfo.image_width      = w;
+        cinfo.image_height     = h;
+        cinfo.input_components = c;
+
+        if (c == 1) cinfo.in_color_space = JCS_GRAYSCALE;
+        if (c == 3) cinfo.in_color_space = JCS_RGB;
+
+        jpeg_set_defaults  (&cinfo);
+        jpeg_set_quality   (&cinfo, 75, TRUE);
+        jpeg_start_compress(&cinfo,     TRUE);
+
+        /* Write each scanline in turn. */
+
+        while (cinfo.next_scanline < cinfo.image_height)
+        {
+            r[0] = (unsigned char *) row(p, s ? s : w * c, h,
+                                         cinfo.next_scanline, o);
+            jpeg_write_scanlines(&cinfo, r, 1);
+        }
+
+        /* Finalize the compression. */
+
+        jpeg_finish_compress (&cinfo);
+        jpeg_destroy_compress(&cinfo);
+
+        fclose(fp);
+    }
+    else fail(name, strerror(errno));
+}
+
+void image_write_jpg(const char *name, int w, int h, int c, int b, void *p)
+{
+    write_jpg(name, w, h, c, b, p, 0, IMAGE_TOP_LEFT);
+}
+
+#endif /* CONFIG_NO_JPG */
+
+/*----------------------------------------------------------------------------*/
+
+#ifndef CONFIG_NO_EXR
+#include <openexr.h>
+
+/* Abort with the OpenEXR error message on any failure.                       */
+
+static void exr_check(const char *name, exr_result_t r)
+{
+    if (r != EXR_ERR_SUCCESS)
+        fail(name, exr_get_default_error_message(r));
+}
+
+/* Return the index of the full-resolution channel named n, or -1.            */
+
+static int exr_find(const exr_attr_chlist_t *l, const char *n)
+{
+    int i;
+
+    for (i = 0; i < l->num_channels; ++i)
+        if (l->entries[i].x_sampling == 1 &&
+            l->entries[i].y_sampling == 1 && strcmp(l->entries[i].name.str, n) == 0)
+            return i;
+
+    return -1;
+}
+
+/* Choose up to four channels of the first part of an EXR file to give the    */
+/* channels of the image: R, G, B, and A if present, else Y and A, else the   */
+/* first channels in file order. Store in k the file channel index feeding    */
+/* each image channel, or -1 if absent. Give half float type if all chosen    */
+/* channels are half, and float otherwise.                                    */
+
+static void exr_layout(const char *name, exr_const_context_t E,
+                       const exr_attr_chlist_t **l, int *k, int *c, int *b)
+{
+    static const char *rgba[] = { "R", "G", "B", "A" };
+
+    int i;
+
+    exr_check(name, exr_get_channels(E, 0, l));
+
+    for (i = 0; i < 4; ++i)
+        k[i] = -1;
+
+    if (exr_find(*l, "R") >= 0 || exr_find(*l, "G") >= 0 || exr_find(*l, "B") >= 0)
+    {
+        for (i = 0; i < 4; ++i)
+            k[i] = exr_find(*l, rgba[i]);
+
+        *c = (k[3] < 0) ? 3 : 4;
+    }
+    else if (exr_find(*l, "Y") >= 0)
+    {
+        k[0] = exr_find(*l, "Y");
+        k[1] = exr_find(*l, "A");
+
+        *c = (k[1] < 0) ? 1 : 2;
+    }
+    else
+    {
+        for (i = 0, *c = 0; i < (*l)->num_channels && *c < 4; ++i)
+            if ((*l)->entries[i].x_sampling == 1 &&
+                (*l)->entries[i].y_sampling == 1)
+                k[(*c)++] = i;
+    }
+
+    if (*c == 0)
+        fail(name, "No usable EXR channels");
+
+    *b = IMAGE_HALF;
+
+    for (i = 0; i < *c; ++i)
+        if (k[i] >= 0 && (*l)->entries[k[i]].pixel_type != EXR_PIXEL_HALF)
+            *b = 4;
+}
+
+struct exr
+{
+    const char               *name;
+    exr_context_t             E;
+    exr_attr_box2i_t          d;
+    const exr_attr_chlist_t  *l;
+    int   k[4];
+    int   c, b, h;
+    int   s, o;
+    int   lines;
+    int   tx, tw, th;
+    void *p;
+};
+
+/* Point the channels of decode pipeline D at pixel x, y of the destination.  */
+/* Channels not selected for the image are skipped by the decoder.            */
+
+static void exr_bind(struct exr *X, exr_decode_pipeline_t *D, int x, int y)
+{
+    const int n = bsize(X->b);
+
+    int i;
+    int j;
+
+    for (j = 0; j < D->channel_count; ++j)
+    {
+        exr_coding_channel_info_t *C = D->channels + j;
+
+        C->decode_to_ptr = NULL;
+
+        for (i = 0; i < X->c; ++i)
+            if (X->k[i] == j)
+            {
+                C->decode_to_ptr          = (uint8_t *) row(X->p, X->s, X->h, y, X->o)
+                                          + (size_t) (x * X->c + i) * n;
+                C->user_pixel_stride      = X->c * n;
+                C->user_line_stride       = (X->o == IMAGE_BOTTOM_LEFT) ? -X->s : X->s;
+                C->user_bytes_per_element = n;
+                C->user_data_type         = (X->b == IMAGE_HALF) ? EXR_PIXEL_HALF
+                                                                 : EXR_PIXEL_FLOAT;
+            }
+    }
+}
+
+/* Decompress chunks i through j directly to the destination buffer.          */
+
+static void exr_chunks(void *d, int i, int j)
+{
+    exr_decode_pipeline_t D = EXR_DECODE_PIPELINE_INITIALIZER;
+    exr_chunk_info_t      C;
+
+    struct exr *X = (struct exr *) d;
+    int         n;
+    int         x;
+    int         y;
+
+    for (n = i; n < j; ++n)
+    {
+        if (X->tx)
+        {
+            x = (n % X->tx) * X->tw;
+            y = (n / X->tx) * X->th;
+            exr_check(X->name, exr_read_tile_chunk_info(X->E, 0, n % X->tx,
+                                                                 n / X->tx, 0, 0, &C));
+        }
+        else
+        {
+            x = 0;
+            y = n * X->lines;
+            exr_check(X->name, exr_read_scanline_chunk_info(X->E, 0, X->d.min.y + y, &C));
+        }
+
+        if (n == i)
+            exr_check(X->name, exr_decoding_initialize(X->E, 0, &C, &D));
+        else
+            exr_check(X->name, exr_decoding_update    (X->E, 0, &C, &D));
+
+        exr_bind(X, &D, x, y);
+
+        if (n == i)
+            exr_check(X->name, exr_decoding_choose_default_routines(X->E, 0, &D));
+
+        exr_check(X->name, exr_decoding_run(X->E, 0, &D));
+    }
+    exr_decoding_destroy(X->E, &D);
+}
+
+static void *read_exr(const char *name, void *p, int s, int o,
+                      int *w, int *h, int *c, int *b)
+{
+    exr_context_initializer_t I = EXR_DEFAULT_CONTEXT_INITIALIZER;
+    exr_storage_t             t;
+    struct exr                X;
+
+    int n = 0;
+    int i;
+
+    assert(name);
+
+    I.alloc_fn = hook_malloc;
+    I.free_fn  = hook_free;
+
+    /* Read the header and choose the image layout. */
+
+    exr_check(name, exr_start_read(&X.E, name, &I));
+    exr_check(name, exr_get_storage(X.E, 0, &t));
+
+    if (t != EXR_STORAGE_SCANLINE && t != EXR_STORAGE_TILED)
+        fail(name, "Deep EXR data is not supported");
+
+    exr_check(name, exr_get_data_window(X.E, 0, &X.d));
+    exr_layout(name, X.E, &X.l, X.k, c, b);
+
+    *w = X.d.max.x - X.d.min.x + 1;
+    *h = X.d.max.y - X.d.min.y + 1;
+
+    X.name = name;
+    X.p    = dest(name, p, &s, *w, *h, *c, *b);
+    X.s    = s;
+    X.o    = o;
+    X.c    = *c;
+    X.b    = *b;
+    X.h    = *h;
+    X.tx   = 0;
+
+    /* Zero any image channel that has no source in the file. */
+
+    for (i = 0; i < X.c; ++i)
+        if (X.k[i] < 0)
+            break;
+
+    if (i < X.c)
+        for (i = 0; i < X.h; ++i)
+            memset(row(X.p, X.s, X.h, i, X.o), 0, (size_t) (*w) * X.c * bsize(X.b));
+
+    /* Count the chunks of the full-resolution level. */
+
+    if (t == EXR_STORAGE_TILED)
+    {
+        exr_tile_level_mode_t lm;
+        exr_tile_round_mode_t rm;
+        uint32_t tw;
+        uint32_t th;
+        int32_t  tx;
+        int32_t  ty;
+
+        exr_check(name, exr_get_tile_descriptor(X.E, 0, &tw, &th, &lm, &rm));
+        exr_check(name, exr_get_tile_counts(X.E, 0, 0, 0, &tx, &ty));
+
+        X.tw = (int) tw;
+        X.th = (int) th;
+        X.tx = tx;
+        n    = tx * ty;
+    }
+    else
+    {
+        int32_t k;
+
+        exr_check(name, exr_get_scanlines_per_chunk(X.E, 0, &k));
+
+        X.lines = k;
+        n       = (X.h + k - 1) / k;
+    }
+
+    /* Decompress all chunks in parallel, each straight to its destination. */
+
+    parallel(exr_chunks, &X, n, 4);
+
+    exr_finish(&X.E);
+
+    return X.p;
+}
+
+static int info_exr(const char *name, int *w, int *h, int *c, int *b)
+{
+    exr_context_initializer_t I = EXR_DEFAULT_CONTEXT_INITIALIZER;
+    exr_context_t             E;
+    exr_attr_box2i_t          d;
+
+    const exr_attr_chlist_t *l;
+    int k[4];
+    int ok = 0;
+
+    I.alloc_fn = hook_malloc;
+    I.free_fn  = hook_free;
+
+    if (exr_start_read(&E, name, &I) == EXR_ERR_SUCCESS)
+    {
+        if (exr_get_data_window(E, 0, &d) == EXR_ERR_SUCCESS)
+        {
+            exr_layout(name, E, &l, k, c, b);
+
+            *w = d.max.x - d.min.x + 1;
+            *h = d.max.y - d.min.y + 1;
+
+            ok = 1;
+        }
+        exr_finish(&E);
+    }
+    return ok;
+}
+
+void *image_read_exr(const char *name, int *w, int *h, int *c, int *b)
+{
+    return read_exr(name, NULL, 0, IMAGE_TOP_LEFT, w, h, c, b);
+}
+
+/* Write a scanline EXR file one chunk at a time, streaming each directly     */
+/* from the source buffer. Half and float images are stored as given, while   */
+/* integer images are first converted to float.                               */
+
+static void write_exr(const char *name, int w, int h, int c, int b,
+                      const void *p, int s, int o)
+{
+    static const char *rgba[] = { "R", "G", "B", "A" };
+    static const char *ya[]   = { "Y", "A" };
+
+    exr_context_initializer_t I = EXR_DEFAULT_CONTEXT_INITIALIZER;
+    exr_encode_pipeline_t     P = EXR_ENCODE_PIPELINE_INITIALIZER;
+    exr_chunk_info_t          C;
+    exr_context_t             E;
+    exr_pixel_type_t          t;
+
+    const char **names = (c < 3) ? ya : rgba;
+
+    float  *q = NULL;
+    int32_t n;
+    int     part;
+    int     i;
+    int     j;
+    int     y;
+
+    assert(name);
+    assert(p);
+
+    if (s == 0)
+        s = w * c * bsize(b);
+
+    if (b != IMAGE_HALF && b != 4)
+    {
+        if ((q = (float *) hook_malloc((size_t) w * h * c * sizeof (float))) == NULL)
+            fail(name, "Failure to allocate EXR buffer");
+
+        for (i = 0; i < h; ++i)
+            image_convert(w, 1, c, b, row(p, s, h, i, o), c, 4, q + (size_t) w * c * i, 0);
+
+        p = q;
+        s = w * c * sizeof (float);
+        o = IMAGE_TOP_LEFT;
+        b = 4;
+    }
+    t = (b == IMAGE_HALF) ? EXR_PIXEL_HALF : EXR_PIXEL_FLOAT;
+
+    I.alloc_fn = hook_malloc;
+    I.free_fn  = hook_free;
+
+    /* Initialize the header. */
+
+    exr_check(name, exr_start_write(&E, name, EXR_WRITE_FILE_DIRECTLY, &I));
+    exr_check(name, exr_add_part(E, "image", EXR_STORAGE_SCANLINE, &part));
+    exr_check(name, exr_initialize_required_attr_simple(E, part, w, h,
+                                                        EXR_COMPRESSION_ZIP));
+    for (i = 0; i < c; ++i)
+        exr_check(name, exr_add_channel(E, part, names[i], t,
+                                        EXR_PERCEPTUALLY_LOGARITHMIC, 1, 1));
+
+    exr_check(name, exr_write_header(E));
+    exr_check(name, exr_get_scanlines_per_chunk(E, part, &n));
+
+    /* Encode each chunk in turn. */
+
+    for (y = 0; y < h; y += n)
+    {
+        exr_check(name, exr_write_scanline_chunk_info(E, part, y, &C));
+
+        if (y == 0)
+            exr_check(name, exr_encoding_initialize(E, part, &C, &P));
+        else
+            exr_check(name, exr_encoding_update    (E, part, &C, &P));
+
+        for (j = 0; j < P.channel_count; ++j)
+            for (i = 0; i < c; ++i)
+                if (strcmp(P.channels[j].channel_name, names[i]) == 0)
+                {
+                    exr_coding_channel_info_t *K = P.channels + j;
+
+                    K->encode_from_ptr        = (const uint8_t *) row(p, s, h, y, o)
+                                              + i * bsize(b);
+                    K->user_pixel_stride      = c * bsize(b);
+                    K->user_line_stride       = (o == IMAGE_BOTTOM_LEFT) ? -s : s;
+                    K->user_bytes_per_element = bsize(b);
+                    K->user_data_type         = t;
+                }
+
+        if (y == 0)
+            exr_check(name, exr_encoding_choose_default_routines(E, part, &P));
+
+        exr_check(name, exr_encoding_run(E, part, &P));
+    }
+
+    exr_encoding_destroy(E, &P);
+    exr_finish(&E);
+
+    image_free(q);
+}
+
+void image_write_exr(const char *name, int w, int h, int c, int b, void *p)
+{
+    write_exr(name, w, h, c, b, p, 0, IMAGE_TOP_LEFT);
+}
+
+#endif /* CONFIG_NO_EXR */
+
+/*----------------------------------------------------------------------------*/
+
+#ifndef CONFIG_NO_TIF
+#include <tiffio.h>
+
+static void *read_tif(const char *name, void *p, int s, int o,
+                      int *w, int *h, int *c, int *b, int n)
+{
+    TIFF *T = 0;
+    void *q = 0;
+
+    TIFFSetWarningHandler(0);
+
+    if ((T = TIFFOpen(name, "r")))
+    {
+        if ((n == 0) || TIFFSetDirectory(T, n))
+        {
+            uint32 W, H, i;
+            uint16 B, C, F = SAMPLEFORMAT_UINT;
+
+            TIFFGetField(T, TIFFTAG_IMAGEWIDTH,      &W);
             TIFFGetField(T, TIFFTAG_IMAGELENGTH,     &H);
             TIFFGetField(T, TIFFTAG_BITSPERSAMPLE,   &B);
             TIFFGetField(T, TIFFTAG_SAMPLESPERPIXEL, &C);
+            TIFFGetField(T, TIFFTAG_SAMPLEFORMAT,    &F);
+
+            *w = (int) W;
+            *h = (int) H;
+            *b = (int) B / 8;
+            *c = (int) C;
+
+            if (F == SAMPLEFORMAT_IEEEFP && B == 16)
+                *b = IMAGE_HALF;
+
+            /* Decode each scanline directly to the destination buffer. */
+
+            q = dest(name, p, &s, *w, *h, *c, *b);
+
+            for (i = 0; i < H; ++i)
+                TIFFReadScanline(T, row(q, s, *h, i, o), i, 0);
+        }
+        TIFFClose(T);
+    }
+    return q;
+}
+
+static int info_tif(const char *name, int *w, int *h, int *c, int *b)
+{
+    TIFF *T = 0;
+
+    TIFFSetWarningHandler(0);
+
+    if ((T = TIFFOpen(name, "r")))
+    {
+        uint32 W, H;
+        uint16 B, C, F = SAMPLEFORMAT_UINT;
+
+        TIFFGetField(T, TIFFTAG_IMAGEWIDTH,      &W);
+        TIFFGetField(T, TIFFTAG_IMAGELENGTH,     &H);
+        TIFFGetField(T, TIFFTAG_BITSPERSAMPLE,   &B);
+        TIFFGetField(T, TIFFTAG_SAMPLESPERPIXEL, &C);
+        TIFFGetField(T, TIFFTAG_SAMPLEFORMAT,    &F);
+
+        *w = (int) W;
+        *h = (int) H;
+        *b = (int) B / 8;
+        *c = (int) C;
+
+        if (F == SAMPLEFORMAT_IEEEFP && B == 16)
+            *b = IMAGE_HALF;
+
+        TIFFClose(T);
+        return 1;
+    }
+    return 0;
+}
+
+void *image_read_tif(const char *name, int *w, int *h, int *c, int *b, int n)
+{
+    return read_tif(name, NULL, 0, IMAGE_TOP_LEFT, w, h, c, b, n);
+}
+
+static void write_tif(const char *name, int w, int h, int c, int b,
+                      int n, void **p, int s, int o)
+{
+    TIFF *T = 0;
+
+    TIFFSetWarningHandler(0);
+
+    if ((T = TIFFOpen(name, "w")))
+    {
+        uint32 k, i;
+
+        for (k = 0; k < n; ++k)
+        {
+            TIFFSetField(T, TIFFTAG_IMAGEWIDTH,      w);
+            TIFFSetField(T, TIFFTAG_IMAGELENGTH,     h);
+            TIFFSetField(T, TIFFTAG_BITSPERSAMPLE, 8*bsize(b));
+            TIFFSetField(T, TIFFTAG_SAMPLESPERPIXEL, c);
+            TIFFSetField(T, TIFFTAG_ORIENTATION,  ORIENTATION_TOPLEFT);
+            TIFFSetField(T, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+            if (c == 1)
+            {
+                TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_MINISBLACK);
+                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (gray_icc), gray_icc);
+            }
+            else
+            {
+                TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_RGB);
+                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (sRGB_icc), sRGB_icc);
+            }
+            if (b == 4 || b == IMAGE_HALF)
+                TIFFSetField(T, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+
+            if (s == 0)
+                s = (int) TIFFScanlineSize(T);
+
+            for (i = 0; i < h; ++i)
+                TIFFWriteScanline(T, row(p[k], s, h, i, o), i, 0);
+
+            TIFFWriteDirectory(T);
+        }
+        TIFFClose(T);
+    }
+}
+
+void image_write_tif(const char *name, int w, int h, int c, int b, int n, void **p)
+{
+    write_tif(name, w, h, c, b, n, p, 0, IMAGE_TOP_LEFT);
+}
+
+#endif /* CONFIG_NO_TIF */
+
+/*----------------------------------------------------------------------------*/
+
+/* QOI encodes each pixel as a run of the previous pixel, a reference to one  */
+/* of 64 recently seen colors, a small difference from the previous pixel, or */
+/* a literal. It is lossless and encodes and decodes many times faster than   */
+/* PNG, which suits frame capture. Only 8-bit RGB and RGBA are representable. */
+
+static int qoi_hash(const unsigned char *v)
+{
+    return (v[0] * 3 + v[1] * 5 + v[2] * 7 + v[3] * 11) & 63;
+}
+
+/* Read the named file, or take the buffer m, giving its data and length.     */
+
+static const unsigned char *qoi_load(const char *name, struct membuf *m,
+                                     unsigned char **f, size_t *n)
+{
+    FILE *fp;
+    long  l;
+
+    *f = NULL;
+
+    if (m)
+    {
+        *n = m->n;
+        return m->p;
+    }
+    if (!(fp = fopen(name, "rb")))
+        fail(name, strerror(errno));
+
+    if (fseek(fp, 0, SEEK_END) == 0 && (l = ftell(fp)) > 0)
+    {
+        if ((*f = (unsigned char *) hook_malloc((size_t) l)) == NULL)
+            fail(name, "Failure to allocate QOI file buffer");
+
+        rewind(fp);
+
+        if (fread(*f, 1, (size_t) l, fp) != (size_t) l)
+            fail(name, strerror(errno));
+
+        *n = (size_t) l;
+    }
+    else *n = 0;
+
+    fclose(fp);
+    return *f;
+}
+
+static void *read_qoi(const char *name, struct membuf *m, void *p, int s, int o,
+                      int *w, int *h, int *c, int *b)
+{
+    const unsigned char *u;
+    unsigned char       *f;
+    unsigned char        t[64][4];
+    unsigned char        v[4] = { 0, 0, 0, 255 };
+    size_t               n;
+    size_t               i = 14;
+    int                  r = 0;
+    int                  x;
+    int                  y;
+
+    assert(w);
+    assert(h);
+    assert(c);
+    assert(b);
+
+    u = qoi_load(name, m, &f, &n);
+
+    /* Parse the header and allocate the destination. */
+
+    if (n < 22 || memcmp(u, "qoif", 4))
+        fail(name, "Not a QOI file");
+
+    *w = (int) get32be(u + 4);
+    *h = (int) get32be(u + 8);
+    *c = (int) u[12];
+    *b = 1;
+
+    if (*w < 1 || *h < 1 || (*c != 3 && *c != 4))
+        fail(name, "Malformed QOI header");
+
+    if (s == 0)
+        s = *w * *c;
+
+    if (p == NULL && (p = hook_malloc((size_t) *w * *h * *c)) == NULL)
+        fail(name, "Failure to allocate image buffer");
+
+    memset(t, 0, sizeof (t));
+
+    /* Decode each pixel. The end marker ensures that any op is complete. */
+
+    for (y = 0; y < *h; ++y)
+    {
+        unsigned char *q = (unsigned char *) row(p, s, *h, y, o);
+
+        for (x = 0; x < *w; ++x, q += *c)
+        {
+            if (r > 0)
+                r--;
+            else
+            {
+                int k;
+
+                if (i + 5 > n)
+                    fail(name, "Truncated QOI file");
+
+                k = u[i++];
+
+                if (k == 0xFE)
+                {
+                    v[0] = u[i++];
+                    v[1] = u[i++];
+                    v[2] = u[i++];
+                }
+                else if (k == 0xFF)
+                {
+                    v[0] = u[i++];
+                    v[1] = u[i++];
+                    v[2] = u[i++];
+                    v[3] = u[i++];
+                }
+                else if ((k & 0xC0) == 0x00)
+                    memcpy(v, t[k], 4);
+
+                else if ((k & 0xC0) == 0x40)
+                {
+                    v[0] += ((k >> 4) & 3) - 2;
+                    v[1] += ((k >> 2) & 3) - 2;
+                    v[2] += ((k     ) & 3) - 2;
+                }
+                else if ((k & 0xC0) == 0x80)
+                {
+                    const int g = (k & 63) - 32;
+                    const int e = u[i++];
+
+                    v[0] += g - 8 + ((e >> 4) & 15);
+                    v[1] += g;
+                    v[2] += g - 8 + ((e     ) & 15);
+                }
+                else r = k & 63;
+
+                memcpy(t[qoi_hash(v)], v, 4);
+            }
+            memcpy(q, v, *c);
+        }
+    }
+
+    image_free(f);
+    return p;
+}
+
+static int info_qoi(const char *name, int *w, int *h, int *c, int *b)
+{
+    unsigned char u[14];
+    FILE         *fp;
+    int           r = 0;
+
+    if ((fp = fopen(name, "rb")))
+    {
+        if (fread(u, 1, 14, fp) == 14 && memcmp(u, "qoif", 4) == 0)
+        {
+            *w = (int) get32be(u + 4);
+            *h = (int) get32be(u + 8);
+            *c = (int) u[12];
+            *b = 1;
+            r  = 1;
+        }
+        fclose(fp);
+    }
+    return r;
+}
+
+static void write_qoi(const char *name, int w, int h, int c, int b,
+                      const void *p, int s, int o)
+{
+    unsigned int   t[64];
+    unsigned char  v[4] = { 0, 0, 0, 255 };
+    unsigned char  a[4] = { 0, 0, 0, 255 };
+    unsigned int   V;
+    unsigned int   A;
+    unsigned char *f;
+    unsigned char *e;
+    FILE          *fp;
+    int            r = 0;
+    int            x;
+    int            y;
+
+    assert(name);
+    assert(p);
+
+    if (b != 1 || (c != 3 && c != 4))
+        fail(name, "Unsupported QOI format");
+
+    if (s == 0)
+        s = w * c;
+
+    /* Allocate for the worst case of a literal for every pixel. */
+
+    if ((f = (unsigned char *) hook_malloc((size_t) w * h * (c + 1) + 22)) == NULL)
+        fail(name, "Failure to allocate QOI file buffer");
+
+    memset(t, 0, sizeof (t));
+    memcpy(&V, v, 4);
+
+    e = f;
+    memcpy(e, "qoif", 4);
+    put32be(e + 4, (unsigned long) w);
+    put32be(e + 8, (unsigned long) h);
+    e[12] = (unsigned char) c;
+    e[13] = 0;
+    e    += 14;
+
+    /* Encode each pixel, taking the given row order. */
+
+    for (y = 0; y < h; ++y)
+    {
+        const unsigned char *q = (const unsigned char *) row(p, s, h, y, o);
+
+        for (x = 0; x < w; ++x, q += c)
+        {
+            /* Pixels are compared as words. */
+
+            if (c == 4)
+                memcpy(a, q, 4);
+            else
+            {
+                a[0] = q[0];
+                a[1] = q[1];
+                a[2] = q[2];
+            }
+            memcpy(&A, a, 4);
+
+            if (A == V)
+            {
+                if (++r == 62)
+                {
+                    *e++ = (unsigned char) (0xC0 | (r - 1));
+                    r = 0;
+                }
+                continue;
+            }
+            if (r > 0)
+            {
+                *e++ = (unsigned char) (0xC0 | (r - 1));
+                r = 0;
+            }
+            {
+                const int k = qoi_hash(a);
+
+                if (t[k] == A)
+                    *e++ = (unsigned char) k;
+                else
+                {
+                    t[k] = A;
+
+                    if (a[3] == v[3])
+                    {
+                        const signed char dr = (signed char) (a[0] - v[0]);
+                        const signed char dg = (signed char) (a[1] - v[1]);
+                        const signed char db = (signed char) (a[2] - v[2]);
+                        const int         rg = dr - dg;
+                        const int         bg = db - dg;
+
+                        if (-2 <= dr && dr <= 1 &&
+                            -2 <= dg && dg <= 1 &&
+                            -2 <= db && db <= 1)
+                            *e++ = (unsigned char) (0x40 | (dr + 2) << 4
+                                                         | (dg + 2) << 2
+                                                         | (db + 2));
+
+                        else if (-32 <= dg && dg <= 31 &&
+                                  -8 <= rg && rg <=  7 &&
+                                  -8 <= bg && bg <=  7)
+                        {
+                            *e++ = (unsigned char) (0x80 | (dg + 32));
+                            *e++ = (unsigned char) ((rg + 8) << 4 | (bg + 8));
+                        }
+                        else
+                        {
+                            *e++ = 0xFE;
+                            *e++ = a[0];
+                            *e++ = a[1];
+                            *e++ = a[2];
+                        }
+                    }
+                    else
+                    {
+                        *e++ = 0xFF;
+                        *e++ = a[0];
+                        *e++ = a[1];
+                        *e++ = a[2];
+                        *e++ = a[3];
+                    }
+                }
+            }
+            memcpy(v, a, 4);
+            V = A;
+        }
+    }
+    if (r > 0)
+        *e++ = (unsigned char) (0xC0 | (r - 1));
+
+    memcpy(e, "\0\0\0\0\0\0\0\1", 8);
+    e += 8;
+
+    /* Write the encoding in one operation. */
+
+    if (!(fp = fopen(name, "wb")))
+        fail(name, strerror(errno));
+
+    if (fwrite(f, 1, (size_t) (e - f), fp) != (size_t) (e - f) || fclose(fp))
+        fail(name, strerror(errno));
+
+    image_free(f);
+}
+
+void *image_read_qoi(const char *name, int *w, int *h, int *c, int *b)
+{
+    return read_qoi(name, NULL, NULL, 0, IMAGE_TOP_LEFT, w, h, c, b);
+}
+
+void image_write_qoi(const char *name, int w, int h, int c, int b, void *p)
+{
+    write_qoi(name, w, h, c, b, p, 0, IMAGE_TOP_LEFT);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Compare the end of string name with string ext.                            */
+
+static int extcmp(const char *name, const char *ext)
+{
+    return strcmp(name + strlen(name) - strlen(ext), ext);
+}
+
+/* Use the file name extension to select an image header query function.      */
+
+int image_info(const char *name, int *w, int *h, int *c, int *b)
+{
+    assert(name);
+
+    if (0) { }
+#ifndef CONFIG_NO_PNG
+    else if (extcmp(name, ".png") == 0) return info_png(name, w, h, c, b);
+    else if (extcmp(name, ".PNG") == 0) return info_png(name, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_JPG
+    else if (extcmp(name, ".jpg") == 0) return info_jpg(name, w, h, c, b);
+    else if (extcmp(name, ".JPG") == 0) return info_jpg(name, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_EXR
+    else if (extcmp(name, ".exr") == 0) return info_exr(name, w, h, c, b);
+    else if (extcmp(name, ".EXR") == 0) return info_exr(name, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_TIF
+    else if (extcmp(name, ".tif") == 0) return info_tif(name, w, h, c, b);
+    else if (extcmp(name, ".TIF") == 0) return info_tif(name, w, h, c, b);
+#endif
+    else if (extcmp(name, ".qoi") == 0) return info_qoi(name, w, h, c, b);
+    else if (extcmp(name, ".QOI") == 0) return info_qoi(name, w, h, c, b);
+    return 0;
+}
+
+/* Use the file name extension to select an image read function, and decode  */
+/* to the given buffer with row stride s, emitting rows in the order given by */
+/* origin o.                                                                  */
+
+void *image_read_into(const char *name, void *p, int s, int o,
+                      int *w, int *h, int *c, int *b)
+{
+    assert(name);
+
+    if (0) { }
+#ifndef CONFIG_NO_PNG
+    else if (extcmp(name, ".png") == 0) return read_png(name, NULL, p, s, o, w, h, c, b);
+    else if (extcmp(name, ".PNG") == 0) return read_png(name, NULL, p, s, o, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_JPG
+    else if (extcmp(name, ".jpg") == 0) return read_jpg(name, NULL, p, s, o, w, h, c, b);
+    else if (extcmp(name, ".JPG") == 0) return read_jpg(name, NULL, p, s, o, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_EXR
+    else if (extcmp(name, ".exr") == 0) return read_exr(name, p, s, o, w, h, c, b);
+    else if (extcmp(name, ".EXR") == 0) return read_exr(name, p, s, o, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_TIF
+    else if (extcmp(name, ".tif") == 0) return read_tif(name, p, s, o, w, h, c, b, 0);
+    else if (extcmp(name, ".TIF") == 0) return read_tif(name, p, s, o, w, h, c, b, 0);
+#endif
+    else if (extcmp(name, ".qoi") == 0) return read_qoi(name, NULL, p, s, o, w, h, c, b);
+    else if (extcmp(name, ".QOI") == 0) return read_qoi(name, NULL, p, s, o, w, h, c, b);
+    else fail(name, "Unsupported image format extension");
+
+    return NULL;
+}
+
+/* Use the file name extension to select an image read function.              */
+
+void *image_read(const char *name, int *w, int *h, int *c, int *b)
+{
+    return image_read_into(name, NULL, 0, IMAGE_TOP_LEFT, w, h, c, b);
+}
+
+/* Use the leading bytes of the n-byte encoded image at d to select an image  */
+/* read function, and decode to the given buffer with row stride s and origin */
+/* o.                                                                         */
+
+void *image_read_mem(const void *d, size_t n, void *p, int s, int o,
+                     int *w, int *h, int *c, int *b)
+{
+    const unsigned char *u = (const unsigned char *) d;
+
+    struct membuf m;
+
+    assert(d);
+
+    m.p = u;
+    m.n = n;
+    m.i = 0;
+
+    if (0) { }
+#ifndef CONFIG_NO_PNG
+    else if (n >= 8 && memcmp(u, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return read_png("image_read_mem", &m, p, s, o, w, h, c, b);
+#endif
+#ifndef CONFIG_NO_JPG
+    else if (n >= 3 && u[0] == 0xFF && u[1] == 0xD8 && u[2] == 0xFF)
+        return read_jpg("image_read_mem", &m, p, s, o, w, h, c, b);
+#endif
+    else if (n >= 4 && memcmp(u, "qoif", 4) == 0)
+        return read_qoi("image_read_mem", &m, p, s, o, w, h, c, b);
+    else fail("image_read_mem", "Unsupported image format");
+
+    return NULL;
+}
+
+/* Use the file name extension to select an image write function, and encode */
+/* from the given buffer with row stride s, taking rows in the order given by */
+/* origin o.                                                                  */
+
+void image_write_from(const char *name, int w, int h, int c, int b,
+                      const void *p, int s, int o)
+{
+    assert(name);
+
+    if (0) { }
+#ifndef CONFIG_NO_PNG
+    else if (extcmp(name, ".png") == 0) write_png(name, w, h, c, b, p, s, o);
+    else if (extcmp(name, ".PNG") == 0) write_png(name, w, h, c, b, p, s, o);
+#endif
+#ifndef CONFIG_NO_JPG
+    else if (extcmp(name, ".jpg") == 0) write_jpg(name, w, h, c, b, p, s, o);
+    else if (extcmp(name, ".JPG") == 0) write_jpg(name, w, h, c, b, p, s, o);
+#endif
+#ifndef CONFIG_NO_EXR
+    else if (extcmp(name, ".exr") == 0) write_exr(name, w, h, c, b, p, s, o);
+    else if (extcmp(name, ".EXR") == 0) write_exr(name, w, h, c, b, p, s, o);
+#endif
+#ifndef CONFIG_NO_TIF
+    else if (extcmp(name, ".tif") == 0) write_tif(name, w, h, c, b, 1, (void **) &p, s, o);
+    else if (extcmp(name, ".TIF") == 0) write_tif(name, w, h, c, b, 1, (void **) &p, s, o);
+#endif
+    else if (extcmp(name, ".qoi") == 0) write_qoi(name, w, h, c, b, p, s, o);
+    else if (extcmp(name, ".QOI") == 0) write_qoi(name, w, h, c, b, p, s, o);
+    else fail(name, "Unsupported image format extension");
+}
+
+/* Use the file name extension to select an image write function.             */
+
+void image_write(const char *name, int w, int h, int c, int b, void *p)
+{
+    image_write_from(name, w, h, c, b, p, 0, IMAGE_TOP_LEFT);
+}
+
+/* Read the image file named src and write it to the file named dst, each in  */
+/* the format given by its extension.                                         */
+
+void image_transcode(const char *src, const char *dst)
+{
+    void *p;
+    int   w;
+    int   h;
+    int   c;
+    int   b;
+
+    if ((p = image_read(src, &w, &h, &c, &b)))
+    {
+        image_write(dst, w, h, c, b, p);
+        image_free(p);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Decode jobs are queued to a pool of worker threads, started on first use.  */
+/* Each job names a file or refers to an encoded buffer, and receives the     */
+/* decoded image. Completion is signaled under the queue mutex.               */
+
+struct image_job
+{
+    struct image_job *next;
+
+    char       *name;
+    const void *data;
+    size_t      size;
+
+    void *p;
+    int   s;
+    int   o;
+
+    void *q;
+    int   w;
+    int   h;
+    int   c;
+    int   b;
+    int   done;
+};
+
+#ifndef CONFIG_NO_THREAD
+static pthread_mutex_t   job_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    job_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t    job_done   = PTHREAD_COND_INITIALIZER;
+static struct image_job *job_head   = NULL;
+static struct image_job *job_tail   = NULL;
+static int               job_count  = 0;
+#endif
+
+static void job_run(struct image_job *J)
+{
+    if (J->name)
+        J->q = image_read_into(J->name, J->p, J->s, J->o,
+                               &J->w, &J->h, &J->c, &J->b);
+    else
+        J->q = image_read_mem (J->data, J->size, J->p, J->s, J->o,
+                               &J->w, &J->h, &J->c, &J->b);
+}
+
+#ifndef CONFIG_NO_THREAD
+static void *job_worker(void *d)
+{
+    struct image_job *J;
+
+    for (;;)
+    {
+        /* Take the next job from the queue, waiting if there is none. */
+
+        pthread_mutex_lock(&job_mutex);
+        {
+            while (job_head == NULL)
+                pthread_cond_wait(&job_queued, &job_mutex);
+
+            J = job_head;
+
+            if ((job_head = J->next) == NULL)
+                job_tail = NULL;
+        }
+        pthread_mutex_unlock(&job_mutex);
+
+        job_run(J);
+
+        pthread_mutex_lock(&job_mutex);
+        {
+            J->done = 1;
+            pthread_cond_broadcast(&job_done);
+        }
+        pthread_mutex_unlock(&job_mutex);
+    }
+    return NULL;
+}
+#endif
+
+/* Queue job J, or run it immediately if no workers can be started.           */
+
+static image_job *job_submit(struct image_job *J)
+{
+#ifndef CONFIG_NO_THREAD
+    pthread_mutex_lock(&job_mutex);
+    {
+        if (job_count == 0)
+        {
+            pthread_t T;
+            int       n = threads();
+            int       i;
+
+            for (i = 0; i < n; ++i)
+                if (pthread_create(&T, NULL, job_worker, NULL) == 0)
+                {
+                    pthread_detach(T);
+                    job_count++;
+                }
+        }
+        if (job_count > 0)
+        {
+            if (job_tail)
+                job_tail->next = J;
+            else
+                job_head = J;
+
+            job_tail = J;
+
+            pthread_cond_signal(&job_queued);
+            pthread_mutex_unlock(&job_mutex);
+            return J;
+        }
+    }
+    pthread_mutex_unlock(&job_mutex);
+#endif
+    job_run(J);
+    J->done = 1;
+    return J;
+}
+
+static struct image_job *job_create(void *p, int s, int o)
+{
+    struct image_job *J;
+
+    if ((J = (struct image_job *) hook_malloc(sizeof (struct image_job))) == NULL)
+        fail("image_async", "Failure to allocate decode job");
+
+    memset(J, 0, sizeof (struct image_job));
+
+    J->p = p;
+    J->s = s;
+    J->o = o;
+
+    return J;
+}
+
+/* Begin decoding the named image file to buffer p with row stride s and      */
+/* origin o, as image_read_into. Return a handle to the pending result.       */
+
+image_job *image_async(const char *name, void *p, int s, int o)
+{
+    struct image_job *J = job_create(p, s, o);
+
+    assert(name);
+
+    if ((J->name = (char *) hook_malloc(strlen(name) + 1)) == NULL)
+        fail(name, "Failure to allocate decode job");
+
+    strcpy(J->name, name);
+
+    return job_submit(J);
+}
+
+/* Begin decoding the n-byte encoded image at d, as image_read_mem. The       */
+/* buffer must remain valid until the job completes.                          */
+
+image_job *image_async_mem(const void *d, size_t n, void *p, int s, int o)
+{
+    struct image_job *J = job_create(p, s, o);
+
+    assert(d);
+
+    J->data = d;
+    J->size = n;
+
+    return job_submit(J);
+}
+
+/* Return true if job J has completed.                                        */
+
+int image_ready(image_job *J)
+{
+    int d;
+
+    assert(J);
+
+#ifndef CONFIG_NO_THREAD
+    pthread_mutex_lock(&job_mutex);
+    d = J->done;
+    pthread_mutex_unlock(&job_mutex);
+#else
+    d = J->done;
+#endif
+    return d;
+}
+
+/* Wait for job J to complete and return its image, releasing the job.        */
+
+void *image_await(image_job *J, int *w, int *h, int *c, int *b)
+{
+    void *q;
+
+    assert(J);
+
+#ifndef CONFIG_NO_THREAD
+    pthread_mutex_lock(&job_mutex);
+    {
+        while (J->done == 0)
+            pthread_cond_wait(&job_done, &job_mutex);
+    }
+    pthread_mutex_unlock(&job_mutex);
+#endif
+    if (w) *w = J->w;
+    if (h) *h = J->h;
+    if (c) *c = J->c;
+    if (b) *b = J->b;
+
+    q = J->q;
+
+    image_free(J->name);
+    image_free(J);
+
+    return q;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Decoded images are cached, keyed by the FNV-1a hash of the file name,      */
+/* modification time, and size, or of the content of an in-memory source.    */
+/* Entries form a list in order of use. Those no longer referenced are        */
+/* evicted from the tail while the total exceeds the byte budget. If a cache  */
+/* directory is set, decoded payloads are also stored there by key.           */
+
+struct cache
+{
+    struct cache *prev;
+    struct cache *next;
+
+    unsigned long long key;
+
+    size_t size;
+    void  *p;
+    int    w;
+    int    h;
+    int    c;
+    int    b;
+    int    refs;
+};
+
+static struct cache *cache_head  = NULL;
+static struct cache *cache_tail  = NULL;
+static size_t        cache_total = 0;
+static size_t        cache_limit = 256 * 1024 * 1024;
+static char         *cache_path  = NULL;
+static unsigned      cache_count = 0;
+
+#ifndef CONFIG_NO_THREAD
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void cache_lock(void)
+{
+#ifndef CONFIG_NO_THREAD
+    pthread_mutex_lock(&cache_mutex);
+#endif
+}
+
+static void cache_unlock(void)
+{
+#ifndef CONFIG_NO_THREAD
+    pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+static unsigned long long fnv(unsigned long long k, const void *p, size_t n)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    size_t               i;
+
+    for (i = 0; i < n; ++i)
+        k = (k ^ u[i]) * 1099511628211ULL;
+
+    return k;
+}
+
+static void cache_unlink(struct cache *E)
+{
+    if (E->prev) E->prev->next = E->next; else cache_head = E->next;
+    if (E->next) E->next->prev = E->prev; else cache_tail = E->prev;
+
+    E->prev = NULL;
+    E->next = NULL;
+}
+
+static void cache_front(struct cache *E)
+{
+    E->next = cache_head;
+
+    if (cache_head)
+        cache_head->prev = E;
+    else
+        cache_tail = E;
+
+    cache_head = E;
+}
+
+/* Find the entry with key k, marking it most recently used and referencing   */
+/* it. The cache must be locked.                                              */
+
+static struct cache *cache_find(unsigned long long k)
+{
+    struct cache *E;
+
+    for (E = cache_head; E; E = E->next)
+        if (E->key == k)
+        {
+            cache_unlink(E);
+            cache_front(E);
+            E->refs++;
+            return E;
+        }
+
+    return NULL;
+}
+
+/* Release the least recently used unreferenced entries until the total size */
+/* is within the budget. The cache must be locked.                            */
+
+static void cache_evict(void)
+{
+    struct cache *E = cache_tail;
+    struct cache *P;
+
+    while (E && cache_total > cache_limit)
+    {
+        P = E->prev;
+
+        if (E->refs == 0)
+        {
+            cache_unlink(E);
+            cache_total -= E->size;
+            image_free(E->p);
+            image_free(E);
+        }
+        E = P;
+    }
+}
+
+/* Give the name of the cache directory file holding the payload with key k,  */
+/* or a temporary name unique to this process and call if tmp is set. Return  */
+/* null if there is no cache directory. The directory is read under the lock  */
+/* as image_cache_dir may replace it at any time.                             */
+
+static char *cache_file(unsigned long long k, int tmp)
+{
+    char  *s = NULL;
+    size_t n;
+
+    cache_lock();
+    {
+        n = cache_path ? strlen(cache_path) + 64 : 0;
+
+        if (cache_path && (s = (char *) hook_malloc(n)))
+        {
+            if (tmp)
+                snprintf(s, n, "%s/%016llx.%d.%u.tmp", cache_path, k,
+                         (int) getpid(), cache_count++);
+            else
+                snprintf(s, n, "%s/%016llx.img", cache_path, k);
+        }
+    }
+    cache_unlock();
+
+    return s;
+}
+
+/* Load the payload with key k from the cache directory, returning null if it */
+/* is absent or malformed. The header gives the magic and the image format.   */
+
+static void *cache_load(unsigned long long k, int *w, int *h, int *c, int *b)
+{
+    void *p = NULL;
+    char *s;
+    FILE *fp;
+    int   d[5];
+
+    if ((s = cache_file(k, 0)))
+    {
+        if ((fp = fopen(s, "rb")))
+        {
+            if (fread(d, sizeof (int), 5, fp) == 5 && d[0] == 0x474d4943
+                && d[1] > 0 && d[2] > 0 && d[3] >= 1 && d[3] <= 4
+                && (d[4] == 1 || d[4] == 2 || d[4] == 4 || d[4] == IMAGE_HALF))
+            {
+                const size_t n = (size_t) d[1] * d[2] * d[3] * bsize(d[4]);
+
+                if ((p = hook_malloc(n)))
+                {
+                    if (fread(p, 1, n, fp) == n)
+                    {
+                        *w = d[1];
+                        *h = d[2];
+                        *c = d[3];
+                        *b = d[4];
+                    }
+                    else
+                    {
+                        image_free(p);
+                        p = NULL;
+                    }
+                }
+            }
+            fclose(fp);
+        }
+        image_free(s);
+    }
+    return p;
+}
+
+/* Store the payload with key k to the cache directory. The file is written   */
+/* under a unique temporary name and renamed so that readers never see it     */
+/* partial and concurrent writers never interleave.                           */
+
+static void cache_store(unsigned long long k, const void *p,
+                        int w, int h, int c, int b)
+{
+    const size_t n = (size_t) w * h * c * bsize(b);
+
+    char *s;
+    char *t;
+    FILE *fp;
+    int   d[5];
+    int   ok;
+
+    d[0] = 0x474d4943;
+    d[1] = w;
+    d[2] = h;
+    d[3] = c;
+    d[4] = b;
+
+    if ((s = cache_file(k, 0)))
+    {
+        if ((t = cache_file(k, 1)))
+        {
+            if ((fp = fopen(t, "wb")))
+            {
+                ok = (fwrite(d, sizeof (int), 5, fp) == 5 &&
+                      fwrite(p, 1, n, fp) == n);
+
+                if (fclose(fp) == 0 && ok)
+                    rename(t, s);
+                else
+                    remove(t);
+            }
+            image_free(t);
+        }
+        image_free(s);
+    }
+}
+
+/* Return the cached image with key k, decoding it from the named file or the */
+/* n bytes at d if necessary. Decoding occurs outside the lock. If another    */
+/* thread caches the same image meanwhile then its entry is used instead.     */
+
+static const void *cache_read(unsigned long long k, const char *name,
+                              const void *d, size_t n,
+                              int *w, int *h, int *c, int *b)
+{
+    struct cache *E;
+    struct cache *F;
+
+    cache_lock();
+    E = cache_find(k);
+    cache_unlock();
+
+    if (E == NULL)
+    {
+        if ((E = (struct cache *) hook_malloc(sizeof (struct cache))) == NULL)
+            fail("image_cache", "Failure to allocate cache entry");
+
+        memset(E, 0, sizeof (struct cache));
+
+        E->key  = k;
+        E->refs = 1;
+
+        if ((E->p = cache_load(k, &E->w, &E->h, &E->c, &E->b)) == NULL)
+        {
+            if (name)
+                E->p = image_read_into(name, NULL, 0, IMAGE_TOP_LEFT,
+                                       &E->w, &E->h, &E->c, &E->b);
+            else
+                E->p = image_read_mem(d, n, NULL, 0, IMAGE_TOP_LEFT,
+                                      &E->w, &E->h, &E->c, &E->b);
+            if (E->p)
+                cache_store(k, E->p, E->w, E->h, E->c, E->b);
+        }
+        if (E->p == NULL)
+        {
+            image_free(E);
+            return NULL;
+        }
+        E->size = (size_t) E->w * E->h * E->c * bsize(E->b);
+
+        cache_lock();
+        {
+            if ((F = cache_find(k)) == NULL)
+            {
+                cache_front(E);
+                cache_total += E->size;
+                cache_evict();
+            }
+        }
+        cache_unlock();
+
+        if (F)
+        {
+            image_free(E->p);
+            image_free(E);
+            E = F;
+        }
+    }
+    *w = E->w;
+    *h = E->h;
+    *c = E->c;
+    *b = E->b;
+
+    return E->p;
+}
+
+/* Return the decoded image of the named file, reading it only if the file    */
+/* has changed since it was last cached. The buffer is shared and must not be */
+/* modified. Release it with image_cache_release.                             */
+
+const void *image_cache_read(const char *name, int *w, int *h, int *c, int *b)
+{
+    unsigned long long k = 14695981039346656037ULL;
+    long long          d[5];
+    struct stat        st;
+
+    assert(name);
+
+    if (stat(name, &st))
+        fail(name, strerror(errno));
+
+    /* Identify the file by device and inode as well as name, so that equal   */
+    /* relative names in different directories differ, and by the time to the */
+    /* nanosecond, so that a rewrite within the same second is seen.          */
+
+    d[0] = (long long) st.st_dev;
+    d[1] = (long long) st.st_ino;
+    d[2] = (long long) st.st_size;
+    d[3] = (long long) st.st_mtime;
+#if   defined(__APPLE__) && defined(st_mtime)
+    d[4] = (long long) st.st_mtimespec.tv_nsec;
+#elif defined(st_mtime)
+    d[4] = (long long) st.st_mtim.tv_nsec;
+#else
+    d[4] = 0;
+#endif
+
+    k = fnv(k, name, strlen(name) + 1);
+    k = fnv(k, d, sizeof (d));
+
+    return cache_read(k, name, NULL, 0, w, h, c, b);
+}
+
+/* Return the decoded image of the n-byte encoded image at d, keyed by its    */
+/* content.                                                                   */
+
+const void *image_cache_read_mem(const void *d, size_t n,
+                                 int *w, int *h, int *c, int *b)
+{
+    unsigned long long k = 14695981039346656037ULL;
+
+    assert(d);
+
+    k = fnv(k, "mem", 4);
+    k = fnv(k, d, n);
+
+    return cache_read(k, NULL, d, n, w, h, c, b);
+}
+
+/* Release a reference to a cached image. Unreferenced images remain cached   */
+/* until evicted.                                                             */
+
+void image_cache_release(const void *p)
+{
+    struct cache *E;
+
+    cache_lock();
+    {
+        for (E = cache_head; E; E = E->next)
+            if (E->p == p)
+            {
+                assert(E->refs > 0);
+                E->refs--;
+                break;
+            }
+
+        assert(E || p == NULL);
+
+        cache_evict();
+    }
+    cache_unlock();
+}
+
+/* Set the byte budget of the cache, evicting unreferenced images as needed.  */
+/* A budget of zero caches only those images currently referenced.           */
+
+void image_cache_limit(size_t n)
+{
+    cache_lock();
+    {
+        cache_limit = n;
+        cache_evict();
+    }
+    cache_unlock();
+}
+
+/* Set the directory in which decoded payloads are stored, or null to         */
+/* disable the disk cache. The directory must exist.                          */
+
+void image_cache_dir(const char *dir)
+{
+    cache_lock();
+    {
+        image_free(cache_path);
+        cache_path = NULL;
+
+        if (dir && (cache_path = (char *) hook_malloc(strlen(dir) + 1)))
+            strcpy(cache_path, dir);
+    }
+    cache_unlock();
+}
+
+/*----------------------------------------------------------------------------*/
+
+static float clamp(float f, float a, float z)
+{
+    if      (f < a) return a;
+    else if (f > z) return z;
+    else            return f;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Convert between single and half precision floating point.                  */
+
+typedef union { unsigned int u; float f; } bits;
+
+static float htof(unsigned short h)
+{
+    unsigned int s = (unsigned int) (h & 0x8000) << 16;
+    unsigned int e = (h >> 10) & 0x1F;
+    unsigned int m = (h      ) & 0x3FF;
+    bits v;
+
+    if (e == 0)
+    {
+        v.f = (float) m / 16777216.0f;
+        v.u = v.u | s;
+    }
+    else if (e == 31)
+        v.u = s | 0x7F800000 | (m << 13);
+    else
+        v.u = s | ((e + 112) << 23) | (m << 13);
+
+    return v.f;
+}
+
+static unsigned short ftoh(float f)
+{
+    unsigned int s, m, r, d, k;
+    int e;
+    bits v;
+
+    v.f = f;
+    s = (v.u >> 16) & 0x8000;
+    e = (int) ((v.u >> 23) & 0xFF) - 112;
+    m = (v.u) & 0x7FFFFF;
+
+    /* Infinity and NaN, overflow, and underflow. */
+
+    if (e == 143) return (unsigned short) (s | 0x7C00 | (m ? 0x200 : 0));
+    if (e >=  31) return (unsigned short) (s | 0x7C00);
+    if (e <  -10) return (unsigned short) (s);
+
+    /* Normal and subnormal values, rounding to nearest even. */
+
+    if (e > 0)
+    {
+        k = 13;
+        r = ((unsigned int) e << 10) | (m >> k);
+    }
+    else
+    {
+        k = 14 - e;
+        m = m | 0x800000;
+        r = m >> k;
+    }
+    d = m & ((1u << k) - 1);
+
+    if (d > (1u << (k - 1)) || (d == (1u << (k - 1)) && (r & 1)))
+        r++;
+
+    return (unsigned short) (s | r);
+}
+
+/* Convert between sRGB-encoded and linear intensity.                         */
+
+static float srgb_lut[256];
+
+static void init_srgb(void)
+{
+    static int init = 0;
+    int i;
+
+    if (!init)
+    {
+        for (i = 0; i < 256; ++i)
+        {
+            float k = i / 255.0f;
+
+            srgb_lut[i] = (k <= 0.04045f) ? k / 12.92f
+                        : powf((k + 0.055f) / 1.055f, 2.4f);
+        }
+        init = 1;
+    }
+}
+
+static float stol(float k)
+{
+    return (k <= 0.04045f) ? k / 12.92f : powf((k + 0.055f) / 1.055f, 2.4f);
+}
+
+static float ltos(float k)
+{
+    return (k <= 0.0031308f) ? k * 12.92f : 1.055f * powf(k, 1.0f / 2.4f) - 0.055f;
+}
+
+/* Decode n channels of type b from p to floating point.                      */
+
+static void decode(float *d, const void *p, int n, int b)
+{
+    int i = 0;
+
+    if (b == 1)
+    {
+        const unsigned char *s = (const unsigned char *) p;
+#ifdef __SSE2__
+        const __m128  k = _mm_set1_ps(1.0f / 255.0f);
+        const __m128i z = _mm_setzero_si128();
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+            __m128i l = _mm_unpacklo_epi8(x, z);
+            __m128i h = _mm_unpackhi_epi8(x, z);
+
+            _mm_storeu_ps(d + i +  0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(l, z)), k));
+            _mm_storeu_ps(d + i +  4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(l, z)), k));
+            _mm_storeu_ps(d + i +  8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(h, z)), k));
+            _mm_storeu_ps(d + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(h, z)), k));
+        }
+#endif
+        for (; i < n; ++i)
+            d[i] = s[i] / 255.0f;
+    }
+    else if (b == 2)
+    {
+        const unsigned short *s = (const unsigned short *) p;
+#ifdef __SSE2__
+        const __m128  k = _mm_set1_ps(1.0f / 65535.0f);
+        const __m128i z = _mm_setzero_si128();
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *) (s + i));
+
+            _mm_storeu_ps(d + i + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(x, z)), k));
+            _mm_storeu_ps(d + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(x, z)), k));
+        }
+#endif
+        for (; i < n; ++i)
+            d[i] = s[i] / 65535.0f;
+    }
+    else if (b == -2)
+    {
+        const unsigned short *s = (const unsigned short *) p;
+#ifdef __F16C__
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(d + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (s + i))));
+#endif
+        for (; i < n; ++i)
+            d[i] = htof(s[i]);
+    }
+    else memmove(d, p, n * sizeof (float));
+}
+
+/* Encode n floating point channels to type b at p, clamping and rounding.    */
+
+static void encode(void *p, const float *s, int n, int b)
+{
+    int i = 0;
+
+    if (b == 1)
+    {
+        unsigned char *d = (unsigned char *) p;
+#ifdef __SSE2__
+        const __m128 k = _mm_set1_ps(255.0f);
+        const __m128 o = _mm_setzero_ps();
+        const __m128 l = _mm_set1_ps(1.0f);
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i +  0), o), l), k));
+            __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i +  4), o), l), k));
+            __m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i +  8), o), l), k));
+            __m128i e = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 12), o), l), k));
+
+            _mm_storeu_si128((__m128i *) (d + i),
+                             _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                              _mm_packs_epi32(c, e)));
+        }
+#endif
+        for (; i < n; ++i)
+            d[i] = (unsigned char) (clamp(s[i], 0.f, 1.f) * 255.0f + 0.5f);
+    }
+    else if (b == 2)
+    {
+        unsigned short *d = (unsigned short *) p;
+#ifdef __SSE2__
+        const __m128  k = _mm_set1_ps(65535.0f);
+        const __m128  o = _mm_setzero_ps();
+        const __m128  l = _mm_set1_ps(1.0f);
+        const __m128i m = _mm_set1_epi32(32768);
+        const __m128i x = _mm_set1_epi16((short) 0x8000);
+
+        /* SSE2 lacks an unsigned 32-to-16 pack, so bias to signed and back. */
+
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 0), o), l), k));
+            __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 4), o), l), k));
+
+            _mm_storeu_si128((__m128i *) (d + i),
+                             _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(a, m),
+                                                           _mm_sub_epi32(b, m)), x));
+        }
+#endif
+        for (; i < n; ++i)
+            d[i] = (unsigned short) (clamp(s[i], 0.f, 1.f) * 65535.0f + 0.5f);
+    }
+    else if (b == -2)
+    {
+        unsigned short *d = (unsigned short *) p;
+#ifdef __F16C__
+        for (; i + 8 <= n; i += 8)
+            _mm_storeu_si128((__m128i *) (d + i),
+                             _mm256_cvtps_ph(_mm256_loadu_ps(s + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+        for (; i < n; ++i)
+            d[i] = ftoh(s[i]);
+    }
+    else memmove(p, s, n * sizeof (float));
+}
+
+/* Apply an sRGB transfer function to the color channels of n pixels of c     */
+/* channels each. Alpha is linear in all cases.                               */
+
+static void transfer(float *p, int n, int c, float (*f)(float))
+{
+    const int k = (c < 3) ? 1 : 3;
+    int i;
+    int j;
+
+    for (i = 0; i < n; ++i)
+        for (j = 0; j < k; ++j)
+            p[i * c + j] = f(p[i * c + j]);
+}
+
+/* Map n pixels of c channels at s to n pixels of C channels at d. Gray is    */
+/* replicated to RGB, RGB is reduced to Rec. 709 luminance, and a missing     */
+/* alpha channel is taken to be opaque.                                       */
+
+static void remap(float *d, const float *s, int n, int c, int C)
+{
+    int i;
+
+    for (i = 0; i < n; ++i, s += c, d += C)
+    {
+        float r, g, b, a;
+
+        if (c < 3)
+            r = g = b = s[0];
+        else
+        {
+            r = s[0];
+            g = s[1];
+            b = s[2];
+        }
+        a = (c == 2) ? s[1] : ((c == 4) ? s[3] : 1.0f);
+
+        switch (C)
+        {
+        case 1:
+            d[0] = (c < 3) ? r : 0.2126f * r + 0.7152f * g + 0.0722f * b;
+            break;
+        case 2:
+            d[0] = (c < 3) ? r : 0.2126f * r + 0.7152f * g + 0.0722f * b;
+            d[1] = a;
+            break;
+        case 3:
+            d[0] = r;
+            d[1] = g;
+            d[2] = b;
+            break;
+        case 4:
+            d[0] = r;
+            d[1] = g;
+            d[2] = b;
+            d[3] = a;
+            break;
+        }
+    }
+}
+
+/* Convert a run of n pixels from (c, b) at p to (C, B) at q.                 */
+
+#define CHUNK 256
+
+static void convert(void *q, int C, int B, const void *p, int c, int b,
+                    int n, int f)
+{
+    float s[CHUNK * 4];
+    float d[CHUNK * 4];
+
+    assert(n <= CHUNK);
+
+    /* Decode. Linearize 8-bit sRGB by table lookup. */
+
+    if (b == 1 && (f & IMAGE_SRGB_TO_LINEAR))
+    {
+        const unsigned char *t = (const unsigned char *) p;
+        const int            k = (c < 3) ? 1 : 3;
+        int i;
+        int j;
+
+        init_srgb();
+
+        for (i = 0; i < n; ++i)
+            for (j = 0; j < c; ++j)
+                s[i * c + j] = (j < k) ? srgb_lut[t[i * c + j]]
+                                       : t[i * c + j] / 255.0f;
+    }
+    else
+    {
+        decode(s, p, n * c, b);
+
+        if (f & IMAGE_SRGB_TO_LINEAR)
+            transfer(s, n, c, stol);
+    }
+
+    /* Change the channel count, if needed, and encode. */
+
+    if (c != C)
+    {
+        remap(d, s, n, c, C);
+
+        if (f & IMAGE_LINEAR_TO_SRGB)
+            transfer(d, n, C, ltos);
+
+        encode(q, d, n * C, B);
+    }
+    else
+    {
+        if (f & IMAGE_LINEAR_TO_SRGB)
+            transfer(s, n, C, ltos);
+
+        encode(q, s, n * C, B);
+    }
+}
+
+/* Convert a w-by-h image with c channels of type b at p to C channels of    */
+/* type B at q. If q is null, allocate a new buffer. If q is p, convert in    */
+/* place, in which case the buffer must be large enough to hold the result.   */
+
+void *image_convert(int w, int h, int c, int b, const void *p,
+                                  int C, int B, void *q, int f)
+{
+    const size_t n = (size_t) w * h;
+    const size_t i = (size_t) c * bsize(b);
+    const size_t o = (size_t) C * bsize(B);
+
+    size_t k;
+
+    assert((1 <= c) && (c <= 4));
+    assert((1 <= C) && (C <= 4));
+    assert(p);
+
+    if (q == NULL && (q = hook_malloc(n * o)) == NULL)
+        fail("image_convert", "Failure to allocate image buffer");
+
+    /* Trivial conversion requires only a copy. */
+
+    if (c == C && b == B && (f & (IMAGE_SRGB_TO_LINEAR |
+                                  IMAGE_LINEAR_TO_SRGB)) == 0)
+    {
+        if (q != p)
+            memmove(q, p, n * o);
+        return q;
+    }
+
+    /* Proceed forward when shrinking and backward when growing, so that an   */
+    /* in-place conversion never overwrites input not yet consumed.           */
+
+    if (o <= i)
+        for (k = 0; k < n; k += CHUNK)
+        {
+            int m = (n - k < CHUNK) ? (int) (n - k) : CHUNK;
+            convert((char *) q + k * o, C, B,
+              (const char *) p + k * i, c, b, m, f);
+        }
+    else
+        for (k = (n + CHUNK - 1) / CHUNK * CHUNK; k > 0; k -= CHUNK)
+        {
+            size_t j = k - CHUNK;
+            int    m = (n - j < CHUNK) ? (int) (n - j) : CHUNK;
+            convert((char *) q + j * o, C, B,
+              (const char *) p + j * i, c, b, m, f);
+        }
+
+    return q;
+}
+
+/*----------------------------------------------------------------------------*/
+
+float *image_read_float(const char *name, int *w, int *h, int *c, int *b)
+{
+    void *p = 0;
+    void *q = 0;
+
+    /* Read the named file. */
+
+    if ((p = image_read(name, w, h, c, b)))
+    {
+        size_t n = (size_t) (*w) * (*h) * (*c);
+
+        /* If the type is already float (b == 4) then return immediately. */
+
+        if ((*b) == 4)
+            return (float *) p;
+
+        /* Otherwise, grow the buffer and convert it in place. */
+
+        if ((q = hook_realloc(p, n * sizeof (float))))
+            image_convert(*w, *h, *c, *b, q, *c, 4, q, 0);
+        else
+            image_free(p);
+    }
+    return (float *) q;
+}
+
+void image_write_float(const char *name, int w, int h, int c, int b, float *q)
+{
+    void *p;
+
+    /* If the caller requests a float file (b = 4) then write immediately. */
+
+    if (b == 4)
+        image_write(name, w, h, c, b, q);
+
+    /* Otherwise, convert the file from float before writing. */
+
+    else if ((p = image_convert(w, h, c, 4, q, c, b, NULL, 0)))
+    {
+        image_write(name, w, h, c, b, p);
+        image_free(p);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Resampling filter kernels and their radii of support.                      */
+
+static float sinc(float x)
+{
+    const float k = 3.14159265358979f * x;
+    return (x == 0.0f) ? 1.0f : sinf(k) / k;
+}
+
+static float kernel(int f, float x)
+{
+    x = fabsf(x);
+
+    switch (f)
+    {
+    case IMAGE_BOX:
+        return (x <= 0.5f) ? 1.0f : 0.0f;
+
+    case IMAGE_TRIANGLE:
+        return (x < 1.0f) ? 1.0f - x : 0.0f;
+
+    case IMAGE_LANCZOS3:
+        return (x < 3.0f) ? sinc(x) * sinc(x / 3.0f) : 0.0f;
+
+    case IMAGE_MITCHELL:
+        if (x < 1.0f) return (7.0f * x * x * x - 12.0f * x * x + 16.0f / 3.0f) / 6.0f;
+        if (x < 2.0f) return (-7.0f / 3.0f * x * x * x + 12.0f * x * x
+                                  - 20.0f * x + 32.0f / 3.0f) / 6.0f;
+    }
+    return 0.0f;
+}
+
+static float radius(int f)
+{
+    switch (f)
+    {
+    case IMAGE_BOX:      return 0.5f;
+    case IMAGE_TRIANGLE: return 1.0f;
+    case IMAGE_LANCZOS3: return 3.0f;
+    case IMAGE_MITCHELL: return 2.0f;
+    }
+    return 1.0f;
+}
+
+/* Precompute the source indices and normalized weights contributing to each */
+/* of N output samples from n input samples. When minifying, the kernel is    */
+/* widened to prefilter. Samples beyond the edge are clamped.                 */
+
+struct taps
+{
+    int    n;
+    int   *i;
+    float *w;
+};
+
+static int init_taps(struct taps *T, int n, int N, int f)
+{
+    const float s = (float) N / n;
+    const float k = (s < 1.0f) ? s : 1.0f;
+    const float r = radius(f) / k;
+
+    int j;
+    int t;
+
+    T->n = (int) ceilf(2.0f * r) + 1;
+    T->i = (int   *) hook_malloc(N * T->n * sizeof (int));
+    T->w = (float *) hook_malloc(N * T->n * sizeof (float));
+
+    if (T->i && T->w)
+    {
+        for (j = 0; j < N; ++j)
+        {
+            const float c  = (j + 0.5f) / s;
+            const int   i0 = (int) floorf(c - r);
+
+            int   *I = T->i + j * T->n;
+            float *W = T->w + j * T->n;
+            float  a = 0.0f;
+
+            for (t = 0; t < T->n; ++t)
+            {
+                int i = i0 + t;
+
+                W[t] = kernel(f, (i + 0.5f - c) * k);
+                I[t] = (i < 0) ? 0 : ((i < n) ? i : n - 1);
+                a   += W[t];
+            }
+
+            /* Normalize, falling back on nearest if the kernel misses. */
+
+            if (a != 0.0f)
+                for (t = 0; t < T->n; ++t)
+                    W[t] /= a;
+            else
+            {
+                W[0] = 1.0f;
+                I[0] = (int) clamp(floorf(c), 0.f, n - 1.f);
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void free_taps(struct taps *T)
+{
+    image_free(T->i);
+    image_free(T->w);
+}
+
+/* Accumulate n floats of x scaled by k onto a.                               */
+
+static void axpy(float *a, const float *x, float k, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 K = _mm_set1_ps(k);
+
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(a + i, _mm_add_ps(_mm_loadu_ps(a + i),
+                             _mm_mul_ps(_mm_loadu_ps(x + i), K)));
+#endif
+    for (; i < n; ++i)
+        a[i] += x[i] * k;
+}
+
+struct resample
+{
+    int w, h, c, b;
+    int W, H;
+    const void *p;
+    void       *q;
+    float      *t;
+    struct taps X;
+    struct taps Y;
+};
+
+/* Resample input rows i through j horizontally into the intermediate.        */
+
+static void resample_x(void *d, int i, int j)
+{
+    struct resample *R = (struct resample *) d;
+
+    const size_t s = (size_t) R->w * R->c * bsize(R->b);
+    const int    n = R->X.n;
+    const int    c = R->c;
+
+    float *row;
+    int    x;
+    int    y;
+    int    t;
+    int    k;
+
+    if ((row = (float *) hook_malloc(R->w * c * sizeof (float))) == NULL)
+        fail("image_resample", "Failure to allocate row buffer");
+
+    for (y = i; y < j; ++y)
+    {
+        float *out = R->t + (size_t) y * R->W * c;
+
+        decode(row, (const char *) R->p + s * y, R->w * c, R->b);
+
+        for (x = 0; x < R->W; ++x)
+        {
+            const int   *I = R->X.i + x * n;
+            const float *W = R->X.w + x * n;
+            float       *o = out    + x * c;
+#ifdef __SSE2__
+            if (c == 4)
+            {
+                __m128 a = _mm_setzero_ps();
+
+                for (t = 0; t < n; ++t)
+                    a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(row + I[t] * 4),
+                                                 _mm_set1_ps(W[t])));
+                _mm_storeu_ps(o, a);
+                continue;
+            }
+#endif
+            for (k = 0; k < c; ++k)
+                o[k] = 0.0f;
+
+            for (t = 0; t < n; ++t)
+                for (k = 0; k < c; ++k)
+                    o[k] += row[I[t] * c + k] * W[t];
+        }
+    }
+    image_free(row);
+}
+
+/* Resample output rows i through j vertically from the intermediate.         */
+
+static void resample_y(void *d, int i, int j)
+{
+    struct resample *R = (struct resample *) d;
+
+    const size_t s = (size_t) R->W * R->c * bsize(R->b);
+    const int    m = R->W * R->c;
+    const int    n = R->Y.n;
+
+    float *acc;
+    int    y;
+    int    t;
+
+    if ((acc = (float *) hook_malloc(m * sizeof (float))) == NULL)
+        fail("image_resample", "Failure to allocate row buffer");
+
+    for (y = i; y < j; ++y)
+    {
+        const int   *I = R->Y.i + y * n;
+        const float *W = R->Y.w + y * n;
+
+        memset(acc, 0, m * sizeof (float));
+
+        for (t = 0; t < n; ++t)
+            if (W[t] != 0.0f)
+                axpy(acc, R->t + (size_t) I[t] * m, W[t], m);
+
+        encode((char *) R->q + s * y, acc, m, R->b);
+    }
+    image_free(acc);
+}
+
+/* Resample a w-by-h image with c channels of type b at p to W-by-H at q      */
+/* using filter f. If q is null, allocate a new buffer.                       */
+
+void *image_resample(int w, int h, int c, int b, const void *p,
+                                  int W, int H, void *q, int f)
+{
+    struct resample R;
+
+    memset(&R, 0, sizeof (R));
+
+    assert(p);
+    assert(w > 0 && h > 0 && W > 0 && H > 0);
+
+    R.w = w;
+    R.h = h;
+    R.c = c;
+    R.b = b;
+    R.W = W;
+    R.H = H;
+    R.p = p;
+    R.q = q ? q : hook_malloc((size_t) W * H * c * bsize(b));
+    R.t = (float *) hook_malloc((size_t) W * h * c * sizeof (float));
+
+    if (R.q && R.t && init_taps(&R.X, w, W, f)
+                   && init_taps(&R.Y, h, H, f))
+    {
+        parallel(resample_x, &R, h, 16);
+        parallel(resample_y, &R, H, 16);
+    }
+    else fail("image_resample", "Failure to allocate image buffer");
+
+    free_taps(&R.Y);
+    free_taps(&R.X);
+    image_free(R.t);
+
+    return R.q;
+}
+
+float *image_scale_float(int W, int H, int w, int h, int c, const float *p)
+{
+    return (float *) image_resample(w, h, c, 4, p, W, H, NULL, IMAGE_TRIANGLE);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Each mipmap level is filtered from the previous one in linear floating     */
+/* point. An even dimension halves with a two-tap box. An odd dimension n     */
+/* reduces to n/2 using a three-tap polyphase box that covers the exact       */
+/* footprint of each output sample.                                           */
+
+struct reduce
+{
+    int   i[3];
+    float w[3];
+};
+
+static void init_reduce(struct reduce *R, int n, int N)
+{
+    int j;
+
+    for (j = 0; j < N; ++j)
+    {
+        if (n == 1)
+        {
+            R[j].i[0] = R[j].i[1] = R[j].i[2] = 0;
+            R[j].w[0] = 1.0f;
+            R[j].w[1] = 0.0f;
+            R[j].w[2] = 0.0f;
+        }
+        else if (n % 2 == 0)
+        {
+            R[j].i[0] = R[j].i[2] = 2 * j;
+            R[j].i[1] = 2 * j + 1;
+            R[j].w[0] = 0.5f;
+            R[j].w[1] = 0.5f;
+            R[j].w[2] = 0.0f;
+        }
+        else
+        {
+            const float k = 1.0f / (2 * N + 1);
+
+            R[j].i[0] = 2 * j;
+            R[j].i[1] = 2 * j + 1;
+            R[j].i[2] = 2 * j + 2;
+            R[j].w[0] = k * (N - j);
+            R[j].w[1] = k * (N);
+            R[j].w[2] = k * (j + 1);
+        }
+    }
+}
+
+struct mipmap
+{
+    int c;
+    int w, h;
+    int W, H;
+    const float   *p;
+    float         *q;
+    struct reduce *X;
+    struct reduce *Y;
+};
+
+static void mipmap_rows(void *d, int i, int j)
+{
+    const struct mipmap *M = (const struct mipmap *) d;
+
+    const int c = M->c;
+    const int s = M->w * c;
+
+    int x;
+    int y;
+    int k;
+    int u;
+    int v;
+
+    for (y = i; y < j; ++y)
+    {
+        const struct reduce *Y = M->Y + y;
+        float               *o = M->q + (size_t) y * M->W * c;
+
+        /* Common case: 2x2 box of RGBA. */
+
+        if (c == 4 && Y->w[2] == 0.0f && M->w % 2 == 0)
+        {
+            const float *a = M->p + (size_t) Y->i[0] * s;
+            const float *b = M->p + (size_t) Y->i[1] * s;
+#ifdef __SSE2__
+            const __m128 q = _mm_set1_ps(0.25f);
+
+            for (x = 0; x < M->W; ++x, a += 8, b += 8, o += 4)
+                _mm_storeu_ps(o, _mm_mul_ps(q,
+                    _mm_add_ps(_mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(a + 4)),
+                               _mm_add_ps(_mm_loadu_ps(b), _mm_loadu_ps(b + 4)))));
+#else
+            for (x = 0; x < M->W; ++x, a += 8, b += 8, o += 4)
+                for (k = 0; k < 4; ++k)
+                    o[k] = 0.25f * (a[k] + a[k + 4] + b[k] + b[k + 4]);
+#endif
+            continue;
+        }
+
+        /* General case: up to 3x3 taps of any channel count. */
+
+        for (x = 0; x < M->W; ++x, o += c)
+        {
+            const struct reduce *X = M->X + x;
+
+            for (k = 0; k < c; ++k)
+                o[k] = 0.0f;
+
+            for     (v = 0; v < 3; ++v)
+                if (Y->w[v] != 0.0f)
+                    for (u = 0; u < 3; ++u)
+                        if (X->w[u] != 0.0f)
+                        {
+                            const float *a = M->p + (size_t) Y->i[v] * s
+                                                  + (size_t) X->i[u] * c;
+                            const float  e = X->w[u] * Y->w[v];
+
+                            for (k = 0; k < c; ++k)
+                                o[k] += a[k] * e;
+                        }
+        }
+    }
+}
+
+/* Return the fraction of the n pixels of p whose alpha, scaled by k, meets   */
+/* the alpha test threshold.                                                  */
+
+static float coverage(const float *p, int n, int c, float k)
+{
+    int i;
+    int m = 0;
+
+    for (i = 0; i < n; ++i)
+        if (p[i * c + c - 1] * k >= 0.5f)
+            m++;
+
+    return (float) m / n;
+}
+
+/* Find the alpha scale giving the n pixels of p the coverage a.              */
+
+static float coverage_scale(const float *p, int n, int c, float a)
+{
+    float k0 = 0.0f;
+    float k1 = 4.0f;
+    int   i;
+
+    for (i = 0; i < 16; ++i)
+    {
+        const float k = (k0 + k1) / 2;
+
+        if (coverage(p, n, c, k) < a)
+            k0 = k;
+        else
+            k1 = k;
+    }
+    return k1;
+}
+
+/* Encode float level p of c channels to q of type b, scaling alpha by k.     */
+
+static void mipmap_store(void *q, const float *p, int w, int h, int c, int b,
+                         int f, float k)
+{
+    const size_t s = (size_t) w * c * bsize(b);
+
+    float *t;
+    int    x;
+    int    y;
+
+    if (k == 1.0f)
+        image_convert(w, h, c, 4, p, c, b, q, f & IMAGE_LINEAR_TO_SRGB);
+
+    else if ((t = (float *) hook_malloc(w * c * sizeof (float))))
+    {
+        for (y = 0; y < h; ++y)
+        {
+            memcpy(t, p + (size_t) y * w * c, w * c * sizeof (float));
+
+            for (x = 0; x < w; ++x)
+                t[x * c + c - 1] *= k;
+
+            image_convert(w, 1, c, 4, t, c, b, (char *) q + s * y,
+                          f & IMAGE_LINEAR_TO_SRGB);
+        }
+        image_free(t);
+    }
+    else fail("image_mipmaps", "Failure to allocate row buffer");
+}
+
+/* Generate the full mipmap chain of the w-by-h image of c channels of type b */
+/* at v[0]. Store pointers to each successive level in v and return the total */
+/* number of levels. All levels are allocated as a single block at v[1].     */
+
+int image_mipmaps(int w, int h, int c, int b, void **v, int f)
+{
+    struct mipmap M;
+
+    size_t n = 0;
+    float *a = NULL;
+    float *t = NULL;
+    float  r = 0.0f;
+    int    l = 1;
+    int    W;
+    int    H;
+
+    assert(v && v[0]);
+    assert((1 <= c) && (c <= 4));
+
+    /* Count the levels and size the output block. */
+
+    for (W = w, H = h; W > 1 || H > 1; ++l)
+    {
+        W = (W > 1) ? W / 2 : 1;
+        H = (H > 1) ? H / 2 : 1;
+        n = n + (size_t) W * H * c * bsize(b);
+    }
+    if (l == 1)
+        return 1;
+
+    /* Allocate the output and linear floating point working buffers. */
+
+    if ((v[1] = hook_malloc(n)) == NULL ||
+        (a = (float *) hook_malloc((size_t) w * h * c * sizeof (float))) == NULL ||
+        (t = (float *) hook_malloc((size_t) (w / 2 > 0 ? w / 2 : 1)
+                                          * (h / 2 > 0 ? h / 2 : 1)
+                                          * c * sizeof (float))) == NULL ||
+        (M.X = (struct reduce *) hook_malloc(w * sizeof (struct reduce))) == NULL ||
+        (M.Y = (struct reduce *) hook_malloc(h * sizeof (struct reduce))) == NULL)
+        fail("image_mipmaps", "Failure to allocate mipmap buffers");
+
+    image_convert(w, h, c, b, v[0], c, 4, a, f & IMAGE_SRGB_TO_LINEAR);
+
+    if ((f & IMAGE_COVERAGE) && (c == 2 || c == 4))
+        r = coverage(a, w * h, c, 1.0f);
+
+    /* Filter each level from the previous, alternating working buffers. */
+
+    M.c = c;
+    M.w = w;
+    M.h = h;
+    M.p = a;
+    M.q = t;
+
+    for (l = 1; M.w > 1 || M.h > 1; ++l)
+    {
+        float k = 1.0f;
+
+        M.W = (M.w > 1) ? M.w / 2 : 1;
+        M.H = (M.h > 1) ? M.h / 2 : 1;
+
+        init_reduce(M.X, M.w, M.W);
+        init_reduce(M.Y, M.h, M.H);
+
+        parallel(mipmap_rows, &M, M.H, 32);
+
+        if (r > 0.0f)
+            k = coverage_scale(M.q, M.W * M.H, c, r);
+
+        mipmap_store(v[l], M.q, M.W, M.H, c, b, f, k);
+
+        if (M.W > 1 || M.H > 1)
+            v[l + 1] = (char *) v[l] + (size_t) M.W * M.H * c * bsize(b);
+
+        /* The previous level becomes the destination of the next. */
+
+        M.p = M.q;
+        M.q = (M.q == t) ? a : t;
+        M.w = M.W;
+        M.h = M.H;
+    }
+
+    image_free(M.Y);
+    image_free(M.X);
+    image_free(t);
+    image_free(a);
+
+    return l;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Block compression encodes each 4x4 block of pixels independently. Blocks   */
+/* are fit in floating point and quantized to the endpoint precision of the   */
+/* format. The fast mode takes endpoints from the bounding box of the block,  */
+/* while the high quality mode uses the principal axis and refines endpoints */
+/* by least squares. Block rows are distributed across threads.               */
+
+typedef float block[16][4];
+
+/* Fit a line to the 16 n-channel pixels x, giving endpoints e0 and e1.       */
+
+static void fit(const block x, int n, int q, float *e0, float *e1)
+{
+    float m[4] = { 0, 0, 0, 0 };
+    float C[4][4];
+    float lo[4];
+    float hi[4];
+    float v[4];
+    int   i;
+    int   j;
+    int   k;
+
+    for (k = 0; k < n; ++k)
+    {
+        lo[k] = hi[k] = x[0][k];
+
+        for (i = 0; i < 16; ++i)
+        {
+            m[k] += x[i][k] / 16.0f;
+            if (lo[k] > x[i][k]) lo[k] = x[i][k];
+            if (hi[k] < x[i][k]) hi[k] = x[i][k];
+        }
+    }
+
+    for     (j = 0; j < n; ++j)
+        for (k = 0; k < n; ++k)
+            for (C[j][k] = 0.0f, i = 0; i < 16; ++i)
+                C[j][k] += (x[i][j] - m[j]) * (x[i][k] - m[k]);
+
+    if (q == 0)
+    {
+        /* Orient the bounding box diagonal with the widest channel and inset */
+        /* it to reduce the error at its extremes.                            */
+
+        for (j = 0, k = 1; k < n; ++k)
+            if (hi[k] - lo[k] > hi[j] - lo[j])
+                j = k;
+
+        for (k = 0; k < n; ++k)
+        {
+            const float d = (hi[k] - lo[k]) / 16.0f;
+
+            if (C[j][k] < 0.0f)
+            {
+                e0[k] = hi[k] - d;
+                e1[k] = lo[k] + d;
+            }
+            else
+            {
+                e0[k] = lo[k] + d;
+                e1[k] = hi[k] - d;
+            }
+        }
+    }
+    else
+    {
+        float t0 =  1e9f;
+        float t1 = -1e9f;
+        float d;
+
+        /* Find the principal axis by power iteration from the diagonal. */
+
+        for (k = 0; k < n; ++k)
+            v[k] = hi[k] - lo[k];
+
+        for (i = 0; i < 8; ++i)
+        {
+            float u[4];
+
+            for (d = 0.0f, j = 0; j < n; ++j)
+            {
+                for (u[j] = 0.0f, k = 0; k < n; ++k)
+                    u[j] += C[j][k] * v[k];
+                d += u[j] * u[j];
+            }
+            if (d < 1e-12f)
+                break;
+
+            for (d = sqrtf(d), k = 0; k < n; ++k)
+                v[k] = u[k] / d;
+        }
+
+        /* Project the pixels onto the axis and take the extremes. */
+
+        for (i = 0; i < 16; ++i)
+        {
+            for (d = 0.0f, k = 0; k < n; ++k)
+                d += (x[i][k] - m[k]) * v[k];
+
+            if (t0 > d) t0 = d;
+            if (t1 < d) t1 = d;
+        }
+        if (t0 > t1)
+            t0 = t1 = 0.0f;
+
+        for (k = 0; k < n; ++k)
+        {
+            e0[k] = clamp(m[k] + v[k] * t0, 0.0f, 255.0f);
+            e1[k] = clamp(m[k] + v[k] * t1, 0.0f, 255.0f);
+        }
+    }
+}
+
+/* Solve for the endpoints e0 and e1 that best fit the n-channel pixels x,    */
+/* given the interpolation weight a of each pixel toward e1.                  */
+
+static int refit(const block x, int n, const float *a, float *e0, float *e1)
+{
+    float aa = 0.0f;
+    float ab = 0.0f;
+    float bb = 0.0f;
+    float d;
+    int   i;
+    int   k;
+
+    for (i = 0; i < 16; ++i)
+    {
+        aa += (1.0f - a[i]) * (1.0f - a[i]);
+        ab += (1.0f - a[i]) * (       a[i]);
+        bb += (       a[i]) * (       a[i]);
+    }
+    if (fabsf(d = aa * bb - ab * ab) < 1e-6f)
+        return 0;
+
+    for (k = 0; k < n; ++k)
+    {
+        float ax = 0.0f;
+        float bx = 0.0f;
+
+        for (i = 0; i < 16; ++i)
+        {
+            ax += (1.0f - a[i]) * x[i][k];
+            bx += (       a[i]) * x[i][k];
+        }
+        e0[k] = clamp((ax * bb - bx * ab) / d, 0.0f, 255.0f);
+        e1[k] = clamp((bx * aa - ax * ab) / d, 0.0f, 255.0f);
+    }
+    return 1;
+}
+
+/* Find the entry of the n-entry palette P nearest to each pixel of x, using  */
+/* the first m channels. Store the indices in I and return the total squared  */
+/* error. With SSE2, pairs of palette entries are compared at once.           */
+
+static int nearest(const block x, int (*P)[4], int n, int m, int *I)
+{
+    int e = 0;
+    int i;
+    int j;
+    int k;
+
+    if (m < 4)
+        for (j = 0; j < n; ++j)
+            P[j][3] = 0;
+
+    for (i = 0; i < 16; ++i)
+    {
+        int D[16];
+        int d = 1 << 30;
+        int v[4];
+
+        for (k = 0; k < 4; ++k)
+            v[k] = (k < m) ? (int) x[i][k] : 0;
+#ifdef __SSE2__
+        {
+            const __m128i X = _mm_setr_epi16(v[0], v[1], v[2], v[3],
+                                             v[0], v[1], v[2], v[3]);
+            for (j = 0; j < n; j += 2)
+            {
+                __m128i s = _mm_setr_epi16(P[j    ][0], P[j    ][1], P[j    ][2], P[j    ][3],
+                                           P[j + 1][0], P[j + 1][1], P[j + 1][2], P[j + 1][3]);
+
+                s = _mm_sub_epi16 (s, X);
+                s = _mm_madd_epi16(s, s);
+                s = _mm_add_epi32 (s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+
+                D[j    ] = _mm_cvtsi128_si32(s);
+                D[j + 1] = _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+            }
+        }
+#else
+        for (j = 0; j < n; ++j)
+            for (D[j] = 0, k = 0; k < 4; ++k)
+                D[j] += (v[k] - P[j][k]) * (v[k] - P[j][k]);
+#endif
+        for (j = 0; j < n; ++j)
+            if (D[j] < d)
+            {
+                d    = D[j];
+                I[i] = j;
+            }
+        e += d;
+    }
+    return e;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int to565(const float *e)
+{
+    return ((int) (e[0] * 31.0f / 255.0f + 0.5f) << 11)
+         | ((int) (e[1] * 63.0f / 255.0f + 0.5f) <<  5)
+         | ((int) (e[2] * 31.0f / 255.0f + 0.5f));
+}
+
+static void from565(int c, int *e)
+{
+    e[0] = ((c >> 11) & 31) << 3 | ((c >> 13) & 7);
+    e[1] = ((c >>  5) & 63) << 2 | ((c >>  9) & 3);
+    e[2] = ((c      ) & 31) << 3 | ((c >>  2) & 7);
+}
+
+/* Choose the BC1 indices of x for the 565 endpoints c0 and c1, with c0 > c1 */
+/* giving four-color mode. Return the squared error.                          */
+
+static int bc1_index(const block x, int c0, int c1, unsigned *bits)
+{
+    int P[4][4];
+    int I[16];
+    int e;
+    int i;
+    int k;
+
+    from565(c0, P[0]);
+    from565(c1, P[1]);
+
+    for (k = 0; k < 3; ++k)
+    {
+        P[2][k] = (2 * P[0][k] + P[1][k]) / 3;
+        P[3][k] = (P[0][k] + 2 * P[1][k]) / 3;
+    }
+
+    e = nearest(x, P, 4, 3, I);
+
+    for (*bits = 0, i = 0; i < 16; ++i)
+        *bits |= (unsigned) I[i] << (2 * i);
+
+    return e;
+}
+
+/* Quantize endpoints e0 and e1 and select indices, keeping the result if its */
+/* error is below the best so far.                                            */
+
+static void bc1_try(const block x, const float *e0, const float *e1,
+                    int *c0, int *c1, unsigned *bits, int *err)
+{
+    unsigned b;
+    int a = to565(e0);
+    int z = to565(e1);
+    int e;
+
+    if (a < z)
+    {
+        e = a;
+        a = z;
+        z = e;
+    }
+    e = bc1_index(x, a, z, &b);
+
+    if (e < *err)
+    {
+        *err  = e;
+        *c0   = a;
+        *c1   = z;
+        *bits = b;
+    }
+}
+
+static void bc1(unsigned char *q, const block x, int f)
+{
+    static const float w[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+    unsigned bits = 0;
+    int      err  = 1 << 30;
+    int      c0   = 0;
+    int      c1   = 0;
+    float    e0[4];
+    float    e1[4];
+    float    a[16];
+    int      i;
+    int      n;
+
+    fit(x, 3, f & IMAGE_QUALITY, e0, e1);
+    bc1_try(x, e0, e1, &c0, &c1, &bits, &err);
+
+    /* The principal axis fit usually wins, but the bounding box fit is       */
+    /* better for some blocks, so try both and refine the better one.         */
+
+    if (f & IMAGE_QUALITY)
+    {
+        fit(x, 3, 0, e0, e1);
+        bc1_try(x, e0, e1, &c0, &c1, &bits, &err);
+    }
+
+    /* Refine the endpoints using the current index assignment. */
+
+    if (f & IMAGE_QUALITY)
+        for (n = 0; n < 2 && c0 != c1; ++n)
+        {
+            for (i = 0; i < 16; ++i)
+                a[i] = w[(bits >> (2 * i)) & 3];
+
+            if (refit(x, 3, a, e0, e1))
+                bc1_try(x, e0, e1, &c0, &c1, &bits, &err);
+        }
+
+    q[0] = (unsigned char) (c0     );
+    q[1] = (unsigned char) (c0 >> 8);
+    q[2] = (unsigned char) (c1     );
+    q[3] = (unsigned char) (c1 >> 8);
+    q[4] = (unsigned char) (bits      );
+    q[5] = (unsigned char) (bits >>  8);
+    q[6] = (unsigned char) (bits >> 16);
+    q[7] = (unsigned char) (bits >> 24);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Choose the BC4 indices of x for the endpoints a0 and a1. The ordering of   */
+/* the endpoints selects eight-level or six-level mode. Return the error.     */
+
+static int bc4_index(const float *x, int a0, int a1, unsigned long long *bits)
+{
+    int P[8];
+    int e = 0;
+    int i;
+    int j;
+
+    P[0] = a0;
+    P[1] = a1;
+
+    if (a0 > a1)
+        for (j = 2; j < 8; ++j)
+            P[j] = ((8 - j) * a0 + (j - 1) * a1) / 7;
+    else
+    {
+        for (j = 2; j < 6; ++j)
+            P[j] = ((6 - j) * a0 + (j - 1) * a1) / 5;
+        P[6] = 0;
+        P[7] = 255;
+    }
+
+    for (*bits = 0, i = 0; i < 16; ++i)
+    {
+        int d = 1 << 30;
+        int b = 0;
+
+        for (j = 0; j < 8; ++j)
+        {
+            const int t = ((int) x[i * 4] - P[j]) * ((int) x[i * 4] - P[j]);
+
+            if (t < d)
+            {
+                d = t;
+                b = j;
+            }
+        }
+        *bits |= (unsigned long long) b << (3 * i);
+        e     += d;
+    }
+    return e;
+}
+
+/* Encode channel k of block x. The six-level mode, which represents 0 and    */
+/* 255 exactly, is considered only in high quality mode.                      */
+
+static void bc4(unsigned char *q, const block x, int k, int f)
+{
+    unsigned long long bits;
+    unsigned long long b;
+
+    int lo = 255, LO = 255;
+    int hi =   0, HI =   0;
+    int a0;
+    int a1;
+    int e;
+    int i;
+
+    for (i = 0; i < 16; ++i)
+    {
+        const int v = (int) x[i][k];
+
+        if (lo > v) lo = v;
+        if (hi < v) hi = v;
+
+        if (v > 0   && LO > v) LO = v;
+        if (v < 255 && HI < v) HI = v;
+    }
+
+    a0 = hi;
+    a1 = lo;
+    e  = bc4_index(x[0] + k, a0, a1, &bits);
+
+    if (a0 == a1)
+        bits = 0;
+
+    else if (f & IMAGE_QUALITY)
+    {
+        if (LO > HI)
+            LO = HI = 0;
+
+        if (bc4_index(x[0] + k, LO, HI, &b) < e)
+        {
+            a0   = LO;
+            a1   = HI;
+            bits = b;
+        }
+    }
+
+    q[0] = (unsigned char) a0;
+    q[1] = (unsigned char) a1;
+
+    for (i = 0; i < 6; ++i)
+        q[i + 2] = (unsigned char) (bits >> (8 * i));
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* BC7 mode 6 stores two RGBA endpoints of seven bits plus a shared low bit   */
+/* each, with sixteen interpolation levels per pixel.                         */
+
+static const int bc7_w[16] = {
+    0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+/* Quantize endpoint e to seven bits per channel, choosing the p-bit giving   */
+/* the least error. Return the 7-bit values in v and the p-bit.               */
+
+static int bc7_quantize(const float *e, int *v)
+{
+    int   best = 0;
+    float err  = 1e9f;
+    int   p;
+    int   k;
+
+    for (p = 0; p < 2; ++p)
+    {
+        float d = 0.0f;
+        int   u[4];
+
+        for (k = 0; k < 4; ++k)
+        {
+            u[k] = (int) clamp(floorf((e[k] - p) / 2.0f + 0.5f), 0.0f, 127.0f);
+            d   += ((u[k] << 1 | p) - e[k]) * ((u[k] << 1 | p) - e[k]);
+        }
+        if (d < err)
+        {
+            err  = d;
+            best = p;
+            memcpy(v, u, sizeof (u));
+        }
+    }
+    return best;
+}
+
+/* Select the indices of x for the quantized endpoints. Return the error.     */
+
+static int bc7_index(const block x, const int *v0, int p0,
+                                    const int *v1, int p1, int *I)
+{
+    int P[16][4];
+    int j;
+    int k;
+
+    for     (j = 0; j < 16; ++j)
+        for (k = 0; k < 4;  ++k)
+            P[j][k] = ((64 - bc7_w[j]) * (v0[k] << 1 | p0)
+                           + bc7_w[j]  * (v1[k] << 1 | p1) + 32) >> 6;
+
+    return nearest(x, P, 16, 4, I);
+}
 
-            if ((p = malloc(H * s)))
-            {
-                for (i = 0; i < H; ++i)
-                    TIFFReadScanline(T, (uint8 *) p + i * s, i, 0);
+static void bc7_try(const block x, const float *e0, const float *e1,
+                    int *v0, int *p0, int *v1, int *p1, int *I, int *err)
+{
+    int u0[4];
+    int u1[4];
+    int J[16];
+    int q0 = bc7_quantize(e0, u0);
+    int q1 = bc7_quantize(e1, u1);
+    int e  = bc7_index(x, u0, q0, u1, q1, J);
+
+    if (e < *err)
+    {
+        *err = e;
+        *p0  = q0;
+        *p1  = q1;
+        memcpy(v0, u0, sizeof (u0));
+        memcpy(v1, u1, sizeof (u1));
+        memcpy(I,  J,  sizeof (J));
+    }
+}
 
-                *w = (int) W;
-                *h = (int) H;
-                *b = (int) B / 8;
-                *c = (int) C;
-            }
+/* Append the n low bits of v to the block q at bit position *b.              */
+
+static void put_bits(unsigned char *q, int *b, unsigned v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i, ++(*b))
+        if ((v >> i) & 1)
+            q[*b >> 3] |= (unsigned char) (1 << (*b & 7));
+}
+
+static void bc7(unsigned char *q, const block x, int f)
+{
+    int   err = 1 << 30;
+    int   v0[4];
+    int   v1[4];
+    int   p0;
+    int   p1;
+    int   I[16];
+    float e0[4];
+    float e1[4];
+    float a[16];
+    int   b = 0;
+    int   i;
+    int   k;
+    int   n;
+
+    fit(x, 4, f & IMAGE_QUALITY, e0, e1);
+    bc7_try(x, e0, e1, v0, &p0, v1, &p1, I, &err);
+
+    if (f & IMAGE_QUALITY)
+        for (n = 0; n < 2; ++n)
+        {
+            for (i = 0; i < 16; ++i)
+                a[i] = bc7_w[I[i]] / 64.0f;
+
+            if (refit(x, 4, a, e0, e1))
+                bc7_try(x, e0, e1, v0, &p0, v1, &p1, I, &err);
         }
-        TIFFClose(T);
+
+    /* The high bit of the first index is implicitly zero, so swap the        */
+    /* endpoints if necessary.                                                */
+
+    if (I[0] > 7)
+    {
+        int t[4];
+
+        memcpy(t,  v0, sizeof (t));
+        memcpy(v0, v1, sizeof (t));
+        memcpy(v1, t,  sizeof (t));
+
+        k  = p0;
+        p0 = p1;
+        p1 = k;
+
+        for (i = 0; i < 16; ++i)
+            I[i] = 15 - I[i];
     }
-    return p;
+
+    memset(q, 0, 16);
+
+    put_bits(q, &b, 1 << 6, 7);
+
+    for (k = 0; k < 4; ++k)
+    {
+        put_bits(q, &b, (unsigned) v0[k], 7);
+        put_bits(q, &b, (unsigned) v1[k], 7);
+    }
+    put_bits(q, &b, (unsigned) p0, 1);
+    put_bits(q, &b, (unsigned) p1, 1);
+    put_bits(q, &b, (unsigned) I[0], 3);
+
+    for (i = 1; i < 16; ++i)
+        put_bits(q, &b, (unsigned) I[i], 4);
 }
 
-void image_write_tif(const char *name, int w, int h, int c, int b, int n, void **p)
+/*----------------------------------------------------------------------------*/
+
+static int block_bytes(int F)
 {
-    TIFF *T = 0;
+    return (F == IMAGE_BC1 || F == IMAGE_BC4) ? 8 : 16;
+}
 
-    TIFFSetWarningHandler(0);
+/* Return the size in bytes of a w-by-h image compressed to format F.         */
 
-    if ((T = TIFFOpen(name, "w")))
-    {
-        uint32 k, i, s;
+size_t image_compressed_size(int w, int h, int F)
+{
+    return (size_t) ((w + 3) / 4) * ((h + 3) / 4) * block_bytes(F);
+}
 
-        for (k = 0; k < n; ++k)
+struct compress
+{
+    int w, h, c, b;
+    int F, f;
+    const void    *p;
+    unsigned char *q;
+};
+
+/* Compress block rows i through j. Each source row is converted to 8-bit     */
+/* RGBA and edge pixels are replicated to fill partial blocks.                */
+
+static void compress_rows(void *d, int i, int j)
+{
+    const struct compress *C = (const struct compress *) d;
+
+    const size_t s = (size_t) C->w * C->c * bsize(C->b);
+    const int    W = (C->w + 3) / 4;
+    const int    n = block_bytes(C->F);
+
+    unsigned char *r;
+    unsigned char *q;
+    block          x;
+    int            u;
+    int            v;
+    int            k;
+    int            y;
+    int            X;
+
+    if ((r = (unsigned char *) hook_malloc(4 * (size_t) C->w * 4)) == NULL)
+        fail("image_compress", "Failure to allocate row buffer");
+
+    for (y = i; y < j; ++y)
+    {
+        for (v = 0; v < 4; ++v)
         {
-            TIFFSetField(T, TIFFTAG_IMAGEWIDTH,      w);
-            TIFFSetField(T, TIFFTAG_IMAGELENGTH,     h);
-            TIFFSetField(T, TIFFTAG_BITSPERSAMPLE, 8*b);
-            TIFFSetField(T, TIFFTAG_SAMPLESPERPIXEL, c);
-            TIFFSetField(T, TIFFTAG_ORIENTATION,  ORIENTATION_TOPLEFT);
-            TIFFSetField(T, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+            const int t = (4 * y + v < C->h) ? 4 * y + v : C->h - 1;
 
-            if (c == 1)
-            {
-                TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_MINISBLACK);
-                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (gray_icc), gray_icc);
-            }
-            else
-            {
-                TIFFSetField(T, TIFFTAG_PHOTOMETRIC,  PHOTOMETRIC_RGB);
-                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof (sRGB_icc), sRGB_icc);
-            }
-            if (b == 4)
-                TIFFSetField(T, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+            image_convert(C->w, 1, C->c, C->b, (const char *) C->p + s * t,
+                          4, 1, r + (size_t) C->w * 4 * v, 0);
+        }
 
-            s = (uint32) TIFFScanlineSize(T);
+        for (X = 0; X < W; ++X)
+        {
+            for     (v = 0; v < 4; ++v)
+                for (u = 0; u < 4; ++u)
+                {
+                    const int t = (4 * X + u < C->w) ? 4 * X + u : C->w - 1;
+                    const unsigned char *o = r + ((size_t) C->w * v + t) * 4;
 
-            for (i = 0; i < h; ++i)
-                TIFFWriteScanline(T, (uint8 *) p[k] + i * s, i, 0);
+                    for (k = 0; k < 4; ++k)
+                        x[v * 4 + u][k] = o[k];
+                }
 
-            TIFFWriteDirectory(T);
+            q = C->q + ((size_t) y * W + X) * n;
+
+            switch (C->F)
+            {
+            case IMAGE_BC1: bc1(q, x, C->f); break;
+            case IMAGE_BC3: bc4(q, x, 3, C->f); bc1(q + 8, x, C->f); break;
+            case IMAGE_BC4: bc4(q, x, 0, C->f); break;
+            case IMAGE_BC5: bc4(q, x, 0, C->f);
+                            bc4(q + 8, x, (C->c == 2) ? 3 : 1, C->f); break;
+            case IMAGE_BC7: bc7(q, x, C->f); break;
+            }
         }
-        TIFFClose(T);
     }
+    image_free(r);
 }
 
-#endif /* CONFIG_NO_TIF */
+/* Compress the w-by-h image of c channels of type b at p to format F at q,   */
+/* using the high quality encoder if f includes IMAGE_QUALITY. If q is null,  */
+/* allocate a new buffer.                                                     */
 
-/*----------------------------------------------------------------------------*/
+void *image_compress(int w, int h, int c, int b, const void *p,
+                     void *q, int F, int f)
+{
+    struct compress C;
 
-/* Compare the end of string name with string ext.                            */
+    assert(p);
+    assert(IMAGE_BC1 <= F && F <= IMAGE_BC7);
+
+    C.w = w;
+    C.h = h;
+    C.c = c;
+    C.b = b;
+    C.F = F;
+    C.f = f;
+    C.p = p;
+    C.q = (unsigned char *) (q ? q : hook_malloc(image_compressed_size(w, h, F)));
+
+    if (C.q)
+        parallel(compress_rows, &C, (h + 3) / 4, 4);
+    else
+        fail("image_compress", "Failure to allocate image buffer");
+
+    return C.q;
+}
 
-static int extcmp(const char *name, const char *ext)
+/*----------------------------------------------------------------------------*/
+
+static void put32(unsigned char *p, unsigned v)
 {
-    return strcmp(name + strlen(name) - strlen(ext), ext);
+    p[0] = (unsigned char) (v      );
+    p[1] = (unsigned char) (v >>  8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
 }
 
-/* Use the file name extension to select an image read function.              */
+/* Write n levels of a w-by-h image compressed to format F to a DDS file.     */
+/* BC1, BC3, BC4, and BC5 use the legacy FourCC header understood by all      */
+/* readers. BC7 and sRGB data require the DX10 extended header.               */
 
-void *image_read(const char *name, int *w, int *h, int *c, int *b)
+void image_write_dds(const char *name, int w, int h, int n, void **v, int F, int f)
 {
+    static const char *fourcc[] = { "", "DXT1", "DXT5", "ATI1", "ATI2", "DX10" };
+    static const int   dxgi[][2] = {
+        {  0,  0 }, { 71, 72 }, { 77, 78 }, { 80, 80 }, { 83, 83 }, { 98, 99 }
+    };
+
+    unsigned char head[148];
+    FILE         *fp;
+    int           x = (F == IMAGE_BC7) || ((f & IMAGE_SRGB) && F <= IMAGE_BC3);
+    int           ok;
+    int           l;
+
     assert(name);
+    assert(v);
+    assert(IMAGE_BC1 <= F && F <= IMAGE_BC7);
 
-    if (0) { }
-#ifndef CONFIG_NO_PNG
-    else if (extcmp(name, ".png") == 0) return image_read_png(name, w, h, c, b);
-    else if (extcmp(name, ".PNG") == 0) return image_read_png(name, w, h, c, b);
-#endif
-#ifndef CONFIG_NO_JPG
-    else if (extcmp(name, ".jpg") == 0) return image_read_jpg(name, w, h, c, b);
-    else if (extcmp(name, ".JPG") == 0) return image_read_jpg(name, w, h, c, b);
-#endif
-#ifndef CONFIG_NO_EXR
-    else if (extcmp(name, ".exr") == 0) return image_read_exr(name, w, h, c, b);
-    else if (extcmp(name, ".EXR") == 0) return image_read_exr(name, w, h, c, b);
-#endif
-#ifndef CONFIG_NO_TIF
-    else if (extcmp(name, ".tif") == 0) return image_read_tif(name, w, h, c, b, 0);
-    else if (extcmp(name, ".TIF") == 0) return image_read_tif(name, w, h, c, b, 0);
-#endif
-    else fail(name, "Unsupported image format extension");
+    memset(head, 0, sizeof (head));
 
-    return NULL;
-}
+    /* Magic number and header. */
 
-/* Use the file name extension to select an image write function.             */
+    memcpy(head, "DDS ", 4);
+    put32(head +   4, 124);
+    put32(head +   8, 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (n > 1 ? 0x20000 : 0));
+    put32(head +  12, (unsigned) h);
+    put32(head +  16, (unsigned) w);
+    put32(head +  20, (unsigned) image_compressed_size(w, h, F));
+    put32(head +  28, (unsigned) n);
 
-void image_write(const char *name, int w, int h, int c, int b, void *p)
-{
-    assert(name);
+    /* Pixel format. */
 
-    if (0) { }
-#ifndef CONFIG_NO_PNG
-    else if (extcmp(name, ".png") == 0) image_write_png(name, w, h, c, b, p);
-    else if (extcmp(name, ".PNG") == 0) image_write_png(name, w, h, c, b, p);
-#endif
-#ifndef CONFIG_NO_JPG
-    else if (extcmp(name, ".jpg") == 0) image_write_jpg(name, w, h, c, b, p);
-    else if (extcmp(name, ".JPG") == 0) image_write_jpg(name, w, h, c, b, p);
-#endif
-#ifndef CONFIG_NO_EXR
-    else if (extcmp(name, ".exr") == 0) image_write_exr(name, w, h, c, b, p);
-    else if (extcmp(name, ".EXR") == 0) image_write_exr(name, w, h, c, b, p);
-#endif
-#ifndef CONFIG_NO_TIF
-    else if (extcmp(name, ".tif") == 0) image_write_tif(name, w, h, c, b, 1, &p);
-    else if (extcmp(name, ".TIF") == 0) image_write_tif(name, w, h, c, b, 1, &p);
-#endif
-    else fail(name, "Unsupported image format extension");
+    put32 (head +  76, 32);
+    put32 (head +  80, 0x4);
+    memcpy(head +  84, fourcc[x ? IMAGE_BC7 : F], 4);
+
+    /* Capabilities. */
+
+    put32(head + 108, 0x1000 | (n > 1 ? 0x8 | 0x400000 : 0));
+
+    /* DX10 extension. */
+
+    if (x)
+    {
+        put32(head + 128, (unsigned) dxgi[F][(f & IMAGE_SRGB) ? 1 : 0]);
+        put32(head + 132, 3);
+        put32(head + 140, 1);
+    }
+
+    if ((fp = fopen(name, "wb")))
+    {
+        const size_t k = x ? 148 : 128;
+
+        ok = (fwrite(head, 1, k, fp) == k);
+
+        for (l = 0; l < n && ok; ++l)
+        {
+            const size_t s = image_compressed_size(w, h, F);
+
+            ok = (fwrite(v[l], 1, s, fp) == s);
+
+            w = (w > 1) ? w / 2 : 1;
+            h = (h > 1) ? h / 2 : 1;
+        }
+        if ((fclose(fp) != 0) | !ok)
+            fail(name, strerror(errno));
+    }
+    else fail(name, strerror(errno));
 }
 
 /*----------------------------------------------------------------------------*/
 
-static float clamp(float f, float a, float z)
+/* Texture container formats, identified by Vulkan format number for KTX2     */
+/* and DXGI format number for DDS, with their OpenGL equivalents.             */
+
+struct texfmt
 {
-    if      (f < a) return a;
-    else if (f > z) return z;
-    else            return f;
+    int vk;
+    int dxgi;
+    int form;
+    int extf;
+    int type;
+    int size;
+    int block;
+};
+
+static const struct texfmt texfmts[] = {
+    {   9, 61, GL_R8,                                   GL_RED,  GL_UNSIGNED_BYTE,  1, 0 },
+    {  16, 49, GL_RG8,                                  GL_RG,   GL_UNSIGNED_BYTE,  2, 0 },
+    {  23,  0, GL_RGB8,                                 GL_RGB,  GL_UNSIGNED_BYTE,  3, 0 },
+    {  29,  0, GL_SRGB8,                                GL_RGB,  GL_UNSIGNED_BYTE,  3, 0 },
+    {  37, 28, GL_RGBA8,                                GL_RGBA, GL_UNSIGNED_BYTE,  4, 0 },
+    {  43, 29, GL_SRGB8_ALPHA8,                         GL_RGBA, GL_UNSIGNED_BYTE,  4, 0 },
+    {  44, 87, GL_RGBA8,                                GL_BGRA, GL_UNSIGNED_BYTE,  4, 0 },
+    {  76, 54, GL_R16F,                                 GL_RED,  GL_HALF_FLOAT,     2, 0 },
+    {  83, 34, GL_RG16F,                                GL_RG,   GL_HALF_FLOAT,     4, 0 },
+    {  97, 10, GL_RGBA16F,                              GL_RGBA, GL_HALF_FLOAT,     8, 0 },
+    { 100, 41, GL_R32F,                                 GL_RED,  GL_FLOAT,          4, 0 },
+    { 109,  2, GL_RGBA32F,                              GL_RGBA, GL_FLOAT,         16, 0 },
+    { 131,  0, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,         0,       0,                 8, 1 },
+    { 132,  0, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT,        0,       0,                 8, 1 },
+    { 133, 71, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT,        0,       0,                 8, 1 },
+    { 134, 72, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT,  0,       0,                 8, 1 },
+    { 135, 74, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT,        0,       0,                16, 1 },
+    { 136, 75, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT,  0,       0,                16, 1 },
+    { 137, 77, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT,        0,       0,                16, 1 },
+    { 138, 78, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT,  0,       0,                16, 1 },
+    { 139, 80, GL_COMPRESSED_RED_RGTC1,                 0,       0,                 8, 1 },
+    { 140, 81, GL_COMPRESSED_SIGNED_RED_RGTC1,          0,       0,                 8, 1 },
+    { 141, 83, GL_COMPRESSED_RG_RGTC2,                  0,       0,                16, 1 },
+    { 142, 84, GL_COMPRESSED_SIGNED_RG_RGTC2,           0,       0,                16, 1 },
+    { 143, 95, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT,   0,       0,                16, 1 },
+    { 144, 96, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT,     0,       0,                16, 1 },
+    { 145, 98, GL_COMPRESSED_RGBA_BPTC_UNORM,           0,       0,                16, 1 },
+    { 146, 99, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM,     0,       0,                16, 1 },
+};
+
+static const struct texfmt *find_texfmt(int vk, int dxgi)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof (texfmts) / sizeof (texfmts[0]); ++i)
+        if ((vk   && texfmts[i].vk   == vk) ||
+            (dxgi && texfmts[i].dxgi == dxgi))
+            return texfmts + i;
+
+    return NULL;
 }
 
-static unsigned char ftob(float f)
+static size_t texfmt_size(const struct texfmt *F, int w, int h)
 {
-    return (unsigned char) (f * 255.0f);
+    if (F->block)
+        return (((size_t) w + 3) / 4) * (((size_t) h + 3) / 4) * F->size;
+    else
+        return (size_t) w * h * F->size;
 }
 
-static unsigned short ftos(float f)
+/* Return nonzero if a w-by-h level fits within n bytes, without overflow.   */
+
+static int texfmt_fits(const struct texfmt *F, int w, int h, size_t n)
 {
-    return (unsigned short) (f * 65535.0f);
+    const size_t x = F->block ? ((size_t) w + 3) / 4 : (size_t) w;
+    const size_t y = F->block ? ((size_t) h + 3) / 4 : (size_t) h;
+
+    return (x <= n / (size_t) F->size / y);
 }
 
-static float btof(unsigned char b)
+static unsigned get32(const unsigned char *p)
 {
-    return (float) b / 255.0f;
+    return (unsigned) p[0]       | (unsigned) p[1] <<  8
+         | (unsigned) p[2] << 16 | (unsigned) p[3] << 24;
 }
 
-static float stof(unsigned short s)
+static unsigned long long get64(const unsigned char *p)
 {
-    return (float) s / 65535.0f;
+    return (unsigned long long) get32(p) | (unsigned long long) get32(p + 4) << 32;
 }
 
-float *image_read_float(const char *name, int *w, int *h, int *c, int *b)
+/*----------------------------------------------------------------------------*/
+
+/* Map the named file into memory, or read it if mapping is unavailable.      */
+
+static unsigned char *map_file(const char *name, size_t *len, int *mapped)
 {
-    void  *p = 0;
-    float *q = 0;
-    int    i;
+    unsigned char *p = NULL;
+    FILE          *fp;
+    long           n;
 
-    /* Read the named file. */
+#ifndef CONFIG_NO_MMAP
+    int fd;
 
-    if ((p = image_read(name, w, h, c, b)))
+    if ((fd = open(name, O_RDONLY)) >= 0)
     {
-        int n = (*w) * (*h) * (*c);
+        struct stat st;
 
-        /* If the type is already float (b == 4) then return immediately. */
-
-        if ((*b) == 4)
-            return (float *) p;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            p = (unsigned char *) mmap(NULL, (size_t) st.st_size, PROT_READ,
+                                       MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+                p = NULL;
+            else
+            {
+                *len    = (size_t) st.st_size;
+                *mapped = 1;
+            }
+        }
+        close(fd);
 
-        /* Otherwise, convert the file before returning. */
+        if (p)
+            return p;
+    }
+#endif
+    *mapped = 0;
 
-        if ((q = (float *) malloc(n * sizeof (float))))
+    if ((fp = fopen(name, "rb")))
+    {
+        if (fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) > 0)
         {
-            if ((*b) == 1)
-                for (i = 0; i < n; ++i)
-                    q[i] = btof(((unsigned char  *) p)[i]);
-            if ((*b) == 2)
-                for (i = 0; i < n; ++i)
-                    q[i] = stof(((unsigned short *) p)[i]);
+            if ((p = (unsigned char *) hook_malloc((size_t) n)))
+            {
+                rewind(fp);
+
+                if (fread(p, 1, (size_t) n, fp) == (size_t) n)
+                    *len = (size_t) n;
+                else
+                {
+                    image_free(p);
+                    p = NULL;
+                }
+            }
         }
-        free(p);
+        fclose(fp);
     }
-    return q;
+    return p;
 }
 
-void image_write_float(const char *name, int w, int h, int c, int b, float *q)
+/* Parse the DDS header, giving the format, size, level count, and offset of  */
+/* the first level.                                                           */
+
+static const struct texfmt *head_dds(const unsigned char *p, size_t len,
+                                     int *w, int *h, int *n, size_t *o)
 {
-    void *p;
-    int   i;
-    int   n = w * h * c;
+    unsigned f;
 
-    /* If the caller requests a float file (b = 4) then write immediately. */
+    if (len < 128 || memcmp(p, "DDS ", 4) || get32(p + 4) != 124)
+        return NULL;
 
-    if (b == 4)
-        image_write(name, w, h, c, b, q);
+    *h = (int) get32(p + 12);
+    *w = (int) get32(p + 16);
+    *n = (int) get32(p + 28);
+    *o = 128;
 
-    /* Otherwise, convert the file to float before writing. */
+    f = get32(p + 80);
 
-    else if ((p = malloc(n * b)))
+    if (f & 0x4)
     {
-        if (b == 1)
-            for (i = 0; i < n; ++i)
-                ((unsigned char  *) p)[i] = ftob(clamp(q[i], 0.f, 1.f));
-        if (b == 2)
-            for (i = 0; i < n; ++i)
-                ((unsigned short *) p)[i] = ftos(clamp(q[i], 0.f, 1.f));
+        /* FourCC, possibly with the DX10 extended header. */
 
-        image_write(name, w, h, c, b, p);
+        if (memcmp(p + 84, "DX10", 4) == 0)
+        {
+            if (len < 148 || get32(p + 132) != 3)
+                return NULL;
+
+            *o = 148;
+            return find_texfmt(0, (int) get32(p + 128));
+        }
+        if (memcmp(p + 84, "DXT1", 4) == 0) return find_texfmt(131, 0);
+        if (memcmp(p + 84, "DXT3", 4) == 0) return find_texfmt(135, 0);
+        if (memcmp(p + 84, "DXT5", 4) == 0) return find_texfmt(137, 0);
+        if (memcmp(p + 84, "ATI1", 4) == 0) return find_texfmt(139, 0);
+        if (memcmp(p + 84, "BC4U", 4) == 0) return find_texfmt(139, 0);
+        if (memcmp(p + 84, "BC4S", 4) == 0) return find_texfmt(140, 0);
+        if (memcmp(p + 84, "ATI2", 4) == 0) return find_texfmt(141, 0);
+        if (memcmp(p + 84, "BC5U", 4) == 0) return find_texfmt(141, 0);
+        if (memcmp(p + 84, "BC5S", 4) == 0) return find_texfmt(142, 0);
+        return NULL;
+    }
+    if ((f & 0x40) && get32(p + 88) == 32)
+    {
+        /* Uncompressed 32-bit RGBA or BGRA. */
 
-        free(p);
+        if (get32(p + 92) == 0x000000ff) return find_texfmt(37, 0);
+        if (get32(p + 92) == 0x00ff0000) return find_texfmt(44, 0);
     }
+    return NULL;
 }
 
-#define LERP(A, B, T) ((A) * (1.0 - (T)) + (B) * (T))
+/* Parse the KTX2 header, giving the format, size, and level count. Reject    */
+/* supercompressed and volume textures.                                       */
 
-float *image_scale_float(int W, int H, int w, int h, int c, const float *p)
+static const struct texfmt *head_ktx2(const unsigned char *p, size_t len,
+                                      int *w, int *h, int *n)
 {
-    float *q;
-    int    I;
-    int    J;
-    int    k;
+    static const unsigned char id[12] = {
+        0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+    };
 
-    if ((q = (float *) malloc(W * H * c * sizeof (float))))
+    if (len < 80 || memcmp(p, id, 12))
+        return NULL;
+
+    if (get32(p + 28) > 1 || get32(p + 44) != 0)
+        return NULL;
+
+    *w = (int) get32(p + 20);
+    *h = (int) get32(p + 24);
+    *n = (int) get32(p + 40);
+
+    if (*h == 0)
+        *h = 1;
+
+    return find_texfmt((int) get32(p + 12), 0);
+}
+
+/* Load levels l through l + n - 1 of the named DDS or KTX2 file, or all      */
+/* levels from l if n is zero. The level data refers directly to the mapped   */
+/* file, ready for upload. Only the first face or array layer is given.       */
+/* Return zero if the file is missing, malformed, or in an unsupported form.  */
+
+int image_read_texture(const char *name, struct image_texture *T, int l, int n)
+{
+    const struct texfmt *F = NULL;
+    unsigned char       *p;
+    size_t               o = 0;
+    int                  k = 0;
+    int                  m = 0;
+    int                  w;
+    int                  h;
+    int                  i;
+
+    assert(name);
+    assert(T);
+
+    memset(T, 0, sizeof (struct image_texture));
+
+    if ((p = map_file(name, &T->len, &T->map)) == NULL)
+        return 0;
+
+    T->buf = p;
+
+    /* Identify the container and the pixel format. */
+
+    if      ((F = head_dds (p, T->len, &w, &h, &m, &o))) k = 1;
+    else if ((F = head_ktx2(p, T->len, &w, &h, &m    ))) k = 2;
+
+    /* Reject dimensions whose top level cannot fit within the file. This also */
+    /* keeps the level sizes below from overflowing.                          */
+
+    if (F == NULL || w < 1 || h < 1 || texfmt_fits(F, w, h, T->len) == 0)
     {
-        for     (I = 0; I < H; I++)
-            for (J = 0; J < W; J++)
-            {
-                float i  = clamp(h * (I + 0.5) / H - 0.5, 0.f, h - 1.f);
-                float j  = clamp(w * (J + 0.5) / W - 0.5, 0.f, w - 1.f);
+        image_free_texture(T);
+        return 0;
+    }
+    if (m < 1)  m = 1;
+    if (m > 32) m = 32;
+
+    /* Find each level, noting those in the requested range. */
+
+    for (i = 0; i < m; ++i)
+    {
+        const size_t s = texfmt_size(F, w, h);
+
+        if (k == 2)
+        {
+            if (80 + 24 * (size_t) (i + 1) > T->len)
+                break;
 
-                int   i0 = (int) floor(i), i1 = (int) ceil(i);
-                int   j0 = (int) floor(j), j1 = (int) ceil(j);
+            o = (size_t) get64(p + 80 + 24 * i);
 
-                float di = i - i0;
-                float dj = j - j0;
+            if (get64(p + 88 + 24 * i) < s)
+                break;
+        }
+        if (o > T->len || s > T->len - o)
+            break;
 
-                for (k = 0; k < c; k++)
-                    q[(W * I + J) * c + k] =
-                        LERP(LERP(p[(w * i0 + j0) * c + k],
-                                  p[(w * i0 + j1) * c + k], dj),
-                             LERP(p[(w * i1 + j0) * c + k],
-                                  p[(w * i1 + j1) * c + k], dj), di);
+        if (i >= l && (n == 0 || i < l + n))
+        {
+            if (T->n == 0)
+            {
+                T->w = w;
+                T->h = h;
             }
+            T->v[T->n] = p + o;
+            T->s[T->n] = s;
+            T->n++;
+        }
+        o += s;
+        w  = (w > 1) ? w / 2 : 1;
+        h  = (h > 1) ? h / 2 : 1;
     }
-    return q;
+
+    if (T->n == 0)
+    {
+        image_free_texture(T);
+        return 0;
+    }
+
+    T->form = F->form;
+    T->extf = F->extf;
+    T->type = F->type;
+
+    return 1;
+}
+
+/* Release the file underlying a loaded texture.                              */
+
+void image_free_texture(struct image_texture *T)
+{
+    assert(T);
+
+#ifndef CONFIG_NO_MMAP
+    if (T->map)
+        munmap(T->buf, T->len);
+    else
+#endif
+        image_free(T->buf);
+
+    T->buf = NULL;
+    T->len = 0;
+    T->n   = 0;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1373,15 +5435,15 @@ float *image_scale_float(int W, int H, int w, int h, int c, const float *p)
 int image_internal_form(int c, int b)
 {
     assert((1 <= c) && (c <= 4));
-    assert((1 <= b) && (b <= 4));
+    assert((1 <= bsize(b)) && (bsize(b) <= 4));
 
     if (b == 1)
         switch (c)
         {
-        case  1: return GL_LUMINANCE;
-        case  2: return GL_LUMINANCE_ALPHA;
-        case  3: return GL_RGB;
-        default: return GL_RGBA;
+        case  1: return GL_LUMINANCE8;
+        case  2: return GL_LUMINANCE8_ALPHA8;
+        case  3: return GL_RGB8;
+        default: return GL_RGBA8;
         }
     if (b == 2)
         switch (c)
@@ -1391,11 +5453,19 @@ int image_internal_form(int c, int b)
         case  3: return GL_RGB16;
         default: return GL_RGBA16;
         }
+    if (b == IMAGE_HALF)
+        switch (c)
+        {
+        case  1: return GL_LUMINANCE16F_ARB;
+        case  2: return GL_LUMINANCE_ALPHA16F_ARB;
+        case  3: return GL_RGB16F;
+        default: return GL_RGBA16F;
+        }
     if (b == 4)
         switch (c)
         {
-        case  1: return GL_RGB32F;
-        case  2: return GL_RGB32F;
+        case  1: return GL_LUMINANCE32F_ARB;
+        case  2: return GL_LUMINANCE_ALPHA32F_ARB;
         case  3: return GL_RGB32F;
         default: return GL_RGBA32F;
         }
@@ -1422,12 +5492,74 @@ int image_external_form(int c)
 
 int image_external_type(int b)
 {
-    assert((1 <= b) && (b <= 4));
+    assert((1 <= bsize(b)) && (bsize(b) <= 4));
+
+    if (b == 1)          return GL_UNSIGNED_BYTE;
+    if (b == 2)          return GL_UNSIGNED_SHORT;
+    if (b == 4)          return GL_FLOAT;
+    if (b == IMAGE_HALF) return GL_HALF_FLOAT;
+
+    return 0;
+}
+
+/* Select sized OpenGL core profile formats for an image with c channels of  */
+/* type b. Give the internal format i, external format e, and type t, plus a  */
+/* texture swizzle s that presents one- and two-channel images as gray and    */
+/* gray-alpha. Flag IMAGE_SRGB selects sRGB storage of 8-bit color, and flag  */
+/* IMAGE_EXPAND selects RGBA storage of RGB. Return the channel count that    */
+/* the uploaded data must have.                                               */
+
+int image_format(int c, int b, int f, int *i, int *e, int *t, int *s)
+{
+    static const int form[4] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+
+    static const int ub[4] = { GL_R8,    GL_RG8,    GL_RGB8,    GL_RGBA8    };
+    static const int sr[4] = { GL_R8,    GL_RG8,    GL_SRGB8,   GL_SRGB8_ALPHA8 };
+    static const int us[4] = { GL_R16,   GL_RG16,   GL_RGB16,   GL_RGBA16   };
+    static const int hf[4] = { GL_R16F,  GL_RG16F,  GL_RGB16F,  GL_RGBA16F  };
+    static const int fl[4] = { GL_R32F,  GL_RG32F,  GL_RGB32F,  GL_RGBA32F  };
+
+    assert((1 <= c) && (c <= 4));
+    assert((1 <= bsize(b)) && (bsize(b) <= 4));
+
+    if (c == 3 && (f & IMAGE_EXPAND))
+        c = 4;
+
+    if      (b == IMAGE_HALF) *i = hf[c - 1];
+    else if (b == 4)          *i = fl[c - 1];
+    else if (b == 2)          *i = us[c - 1];
+    else if (f & IMAGE_SRGB)  *i = sr[c - 1];
+    else                      *i = ub[c - 1];
 
-    if (b == 1) return GL_UNSIGNED_BYTE;
-    if (b == 2) return GL_UNSIGNED_SHORT;
-    if (b == 4) return GL_FLOAT;
+    *e = form[c - 1];
+    *t = image_external_type(b);
 
+    s[0] = GL_RED;
+    s[1] = (c < 3) ? GL_RED : GL_GREEN;
+    s[2] = (c < 3) ? GL_RED : GL_BLUE;
+    s[3] = (c == 2) ? GL_GREEN : ((c == 4) ? GL_ALPHA : GL_ONE);
+
+    return c;
+}
+
+/* Select an OpenGL compressed internal format for block compression format  */
+/* F, with sRGB decoding if f includes IMAGE_SRGB.                            */
+
+int image_compressed_form(int F, int f)
+{
+    const int s = (f & IMAGE_SRGB) ? 1 : 0;
+
+    switch (F)
+    {
+    case IMAGE_BC1: return s ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+                             : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    case IMAGE_BC3: return s ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT
+                             : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    case IMAGE_BC4: return GL_COMPRESSED_RED_RGTC1;
+    case IMAGE_BC5: return GL_COMPRESSED_RG_RGTC2;
+    case IMAGE_BC7: return s ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM
+                             : GL_COMPRESSED_RGBA_BPTC_UNORM;
+    }
     return 0;
 }
 
@@ -21,13 +21,86 @@
 #ifndef UTIL3D_IMAGE_H
 #define UTIL3D_IMAGE_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /*----------------------------------------------------------------------------*/
 
-void image_flip(int, int, int, int, void *);
+/* A channel type of IMAGE_HALF selects 16-bit floating point storage.        */
+
+enum {
+    IMAGE_HALF = -2
+};
+
+enum {
+    IMAGE_SRGB_TO_LINEAR = 1,
+    IMAGE_LINEAR_TO_SRGB = 2,
+    IMAGE_SRGB           = 3,
+    IMAGE_COVERAGE       = 4,
+    IMAGE_EXPAND         = 8,
+    IMAGE_QUALITY        = 16
+};
+
+/* Row order of a pixel buffer: top row first, or GL's bottom row first.     */
+
+enum {
+    IMAGE_TOP_LEFT,
+    IMAGE_BOTTOM_LEFT
+};
+
+/* Block compression formats.                                                 */
+
+enum {
+    IMAGE_BC1 = 1,
+    IMAGE_BC3,
+    IMAGE_BC4,
+    IMAGE_BC5,
+    IMAGE_BC7
+};
+
+enum {
+    IMAGE_BOX,
+    IMAGE_TRIANGLE,
+    IMAGE_LANCZOS3,
+    IMAGE_MITCHELL
+};
+
+/* A texture loaded from a DDS or KTX2 container, ready for upload.           */
+
+struct image_texture
+{
+    int         w;              /* Size of the first level                    */
+    int         h;
+    int         n;              /* Number of levels                           */
+    int         form;           /* OpenGL internal format                     */
+    int         extf;           /* OpenGL external format, or 0 if compressed */
+    int         type;           /* OpenGL external type, or 0 if compressed   */
+    const void *v[32];          /* Data of each level                         */
+    size_t      s[32];          /* Size of each level in bytes                */
+
+    void       *buf;            /* Mapped or allocated file contents          */
+    size_t      len;
+    int         map;
+};
+
+/*----------------------------------------------------------------------------*/
+
+typedef void *(*image_malloc_f) (size_t);
+typedef void *(*image_realloc_f)(void *, size_t);
+typedef void  (*image_free_f)   (void *);
+
+void image_allocator(image_malloc_f, image_realloc_f, image_free_f);
+void image_free(void *);
+void image_threads(int);
+
+/*----------------------------------------------------------------------------*/
+
+void image_flip     (int, int, int, int, void *);
+void image_transpose(int, int, int, int, const void *, void *);
+void image_rotate   (int, int, int, int, const void *, void *, int);
 
 /*----------------------------------------------------------------------------*/
 
@@ -43,21 +116,57 @@ void image_write_exr(const char *, int,   int,   int,   int, void *);
 void *image_read_tif(const char *, int *, int *, int *, int *, int);
 void image_write_tif(const char *, int,   int,   int,   int,   int, void **);
 
+void *image_read_qoi(const char *, int *, int *, int *, int *);
+void image_write_qoi(const char *, int,   int,   int,   int, void *);
+
 /*----------------------------------------------------------------------------*/
 
+int    image_info(const char *, int *, int *, int *, int *);
 void  *image_read(const char *, int *, int *, int *, int *);
 void  image_write(const char *, int,   int,   int,   int, void *);
+void  image_transcode(const char *, const char *);
+
+void  *image_read_into(const char *, void *, int, int, int *, int *, int *, int *);
+void  image_write_from(const char *, int, int, int, int, const void *, int, int);
+void  *image_read_mem (const void *, size_t, void *, int, int, int *, int *, int *, int *);
+
+typedef struct image_job image_job;
+
+image_job *image_async    (const char *, void *, int, int);
+image_job *image_async_mem(const void *, size_t, void *, int, int);
+int        image_ready    (image_job *);
+void      *image_await    (image_job *, int *, int *, int *, int *);
+
+const void *image_cache_read    (const char *, int *, int *, int *, int *);
+const void *image_cache_read_mem(const void *, size_t, int *, int *, int *, int *);
+void        image_cache_release (const void *);
+void        image_cache_limit   (size_t);
+void        image_cache_dir     (const char *);
 
 float  *image_read_float(const char *, int *, int *, int *, int *);
 void   image_write_float(const char *, int,   int,   int,   int, float *);
 float *image_scale_float(int, int, int, int, int, const float *);
 
+void *image_convert (int, int, int, int, const void *, int, int, void *, int);
+void *image_resample(int, int, int, int, const void *, int, int, void *, int);
+int   image_mipmaps (int, int, int, int, void **, int);
+
+size_t image_compressed_size(int, int, int);
+void  *image_compress(int, int, int, int, const void *, void *, int, int);
+void   image_write_dds(const char *, int, int, int, void **, int, int);
+
+int    image_read_texture(const char *, struct image_texture *, int, int);
+void   image_free_texture(struct image_texture *);
+
 /*----------------------------------------------------------------------------*/
 
 int image_internal_form(int, int);
 int image_external_form(int);
 int image_external_type(int);
 
+int image_format(int, int, int, int *, int *, int *, int *);
+int image_compressed_form(int, int);
+
 /*----------------------------------------------------------------------------*/
 
 #ifdef __cplusplus